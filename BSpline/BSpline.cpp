@@ -22,6 +22,7 @@
  **/
 #include "BSpline.h"
 #include "BandedMatrix.h"
+#include "BSplineKernels.h"
 
 #include <vector>
 #include <algorithm>
@@ -30,6 +31,7 @@
 #include <iomanip>
 #include <map>
 #include <assert.h>
+#include <cmath>
 
 
 //////////////////////////////////////////////////////////////////////
@@ -37,9 +39,35 @@
 // BSpline Class
 //////////////////////////////////////////////////////////////////////
 
-template<class T> struct BSplineP {
+template<class T, class C> struct BSplineP {
+        BSplineP() : usePolynomials(false), yWy(0), residualVariance(0) {}
+
         std::vector<T> spline;
-        std::vector<T> A;
+
+        // The coefficients are solved for in the compute type.
+        std::vector<C> A;
+
+        // The coefficients extended by the virtual nodes -1 and M+1, for
+        // the closed-form evaluation kernels.
+        std::vector<T> E;
+
+        // The optional table of the polynomial coefficients of each node
+        // interval, built on demand after each solve.
+        bool usePolynomials;
+        std::vector<T> Poly;
+
+        // The integral from xmin to each node of the curve without its
+        // mean, in units of the node interval, built on demand after each
+        // solve.  Summed in double so long domains keep their precision.
+        std::vector<double> Integrals;
+
+        // The weighted sum of the squares of the y values less their mean,
+        // from solve(), and the elements of (P+Q)^-1 within its upper
+        // bands, four per node, with the residual variance, built on
+        // demand after each solve.
+        double yWy;
+        std::vector<C> Inverse;
+        double residualVariance;
 };
 
 //////////////////////////////////////////////////////////////////////
@@ -50,40 +78,77 @@ template<class T> struct BSplineP {
  * This BSpline constructor constructs and sets up a new base and 
  * solves for the spline curve coeffiecients all at once.
  */
-template<class T> BSpline<T>::BSpline(const T *x,
-                                      int nx,
-                                      const T *y,
-                                      double wl,
-                                      int bc_type,
-                                      int num_nodes) :
-    BSplineBase<T>(x, nx, wl, bc_type, num_nodes), s(new BSplineP<T>) {
+template<class T, class C> BSpline<T, C>::BSpline(const T *x,
+                                                  int nx,
+                                                  const T *y,
+                                                  double wl,
+                                                  int bc_type,
+                                                  int num_nodes) :
+    BSplineBase<T, C>(x, nx, wl, bc_type, num_nodes), s(new BSplineP<T, C>) {
     solve(y);
 }
 //////////////////////////////////////////////////////////////////////
 /*
  * Create a new spline given a BSplineBase.
  */
-template<class T> BSpline<T>::BSpline(BSplineBase<T> &bb,
-                                      const T *y) :
-    BSplineBase<T>(bb), s(new BSplineP<T>) {
+template<class T, class C>
+BSpline<T, C>::BSpline(const BSplineBase<T, C> &bb,
+                       const T *y) :
+    BSplineBase<T, C>(bb), s(new BSplineP<T, C>) {
     solve(y);
 }
 //////////////////////////////////////////////////////////////////////
+template<class T, class C>
+BSpline<T, C>::BSpline(const BSpline<T, C> &b) :
+    BSplineBase<T, C>(b), s(new BSplineP<T, C>(*b.s)), mean(b.mean) {
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+BSpline<T, C>::BSpline(BSpline<T, C> &&b) :
+    BSplineBase<T, C>(std::move(b)), s(b.s), mean(b.mean) {
+    b.s = new BSplineP<T, C>;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+BSpline<T, C> &BSpline<T, C>::operator=(const BSpline<T, C> &b) {
+    if (this != &b) {
+        BSplineBase<T, C>::operator=(b);
+        *s = *b.s;
+        mean = b.mean;
+    }
+    return *this;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+BSpline<T, C> &BSpline<T, C>::operator=(BSpline<T, C> &&b) {
+    if (this != &b) {
+        BSplineBase<T, C>::operator=(std::move(b));
+        std::swap(s, b.s);
+        *b.s = BSplineP<T, C>();
+        mean = b.mean;
+    }
+    return *this;
+}
+//////////////////////////////////////////////////////////////////////
 /*
  * (Re)calculate the spline for the given set of y values.
  */
-template<class T> bool BSpline<T>::solve(const T *y) {
+template<class T, class C> bool BSpline<T, C>::solve(const T *y) {
     if (!OK)
         return false;
 
     // Any previously calculated curve is now invalid.
     s->spline.clear();
+    s->E.clear();
+    s->Poly.clear();
+    s->Integrals.clear();
+    s->Inverse.clear();
     OK = false;
 
     // Given an array of data points over x and its precalculated
     // P+Q matrix, calculate the b vector and solve for the coefficients.
-    std::vector<T> &B = s->A;
-    std::vector<T> &A = s->A;
+    std::vector<C> &B = s->A;
+    std::vector<C> &A = s->A;
     A.clear();
     A.resize(M+1);
 
@@ -91,26 +156,42 @@ template<class T> bool BSpline<T>::solve(const T *y) {
         std::cerr << "Solving for B..." << std::endl;
 
     // Find the mean of these data
-    mean = 0.0;
-    int i;
-    for (i = 0; i < NX; ++i) {
-        mean += y[i];
-    }
-    mean = mean / (double)NX;
+    mean = this->dataMean(y);
     if (Debug())
         std::cerr << "Mean for y: " << mean << std::endl;
 
+    // Weight each point if the domain has weights, and sum the squares
+    // for the residual variance.
+    const T *W = base->W.empty() ? 0 : &base->W[0];
+    double ywy = 0;
     int m, j;
-    for (j = 0; j < NX; ++j) {
-        // Which node does this put us in?
-        T &xj = base->X[j];
-        T yj = y[j] - mean;
-        int mx = (int)((xj - xmin) / DX);
-
-        for (m = my::max(0, mx-1); m <= my::min(mx+2, M); ++m) {
-            B[m] += yj * Basis(m, xj);
+    if (!base->Start.empty()) {
+        // Gather from the cached basis weights.
+        const int *start = &base->Start[0];
+        const C *w = &base->Weights[0];
+        for (j = 0; j < NX; ++j, w += 4) {
+            C rj = y[j] - mean;
+            C yj = W ? rj * W[j] : rj;
+            ywy += yj * rj;
+            C *b = &B[start[j]];
+            b[0] += yj * w[0];
+            b[1] += yj * w[1];
+            b[2] += yj * w[2];
+            b[3] += yj * w[3];
+        }
+    } else {
+        const XArray<T> X = base->xvalues();
+        C w[4];
+        for (j = 0; j < NX; ++j) {
+            C rj = y[j] - mean;
+            C yj = W ? rj * W[j] : rj;
+            ywy += yj * rj;
+            int start = basisWeights(X[j], w);
+            for (m = 0; m < 4 && start+m <= M; ++m)
+                B[start+m] += yj * w[m];
         }
     }
+    s->yWy = ywy;
 
     if (Debug() && M < 30) {
         std::cerr << "Solution a for (P+Q)a = b" << std::endl;
@@ -118,52 +199,467 @@ template<class T> bool BSpline<T>::solve(const T *y) {
     }
 
     // Now solve for the A vector in place.
-    if (LU_solve_banded(base->Q, A, 3) != 0) {
+    if (!this->solveBanded(&A[0], 1)) {
         if (Debug())
-            std::cerr << "LU_solve_banded() failed." << std::endl;
+            std::cerr << "Solving (P+Q)a = b failed." << std::endl;
     } else {
         OK = true;
+        extendCoefficients();
         if (Debug())
             std::cerr << "Done." << std::endl;
         if (Debug() && M < 30) {
             std::cerr << " a: " << A << std::endl;
-            std::cerr << "LU factor of (P+Q) = " << std::endl << base->Q
+            std::cerr << "Factor of (P+Q) = " << std::endl << base->Q
                     << std::endl;
         }
     }
     return (OK);
 }
 //////////////////////////////////////////////////////////////////////
-template<class T> BSpline<T>::~BSpline() {
+template<class T, class C> BSpline<T, C>::~BSpline() {
     delete s;
 }
 //////////////////////////////////////////////////////////////////////
-template<class T> T BSpline<T>::coefficient(int n) {
+template<class T, class C> T BSpline<T, C>::coefficient(int n) {
     if (OK)
         if (0 <= n && n <= M)
             return s->A[n];
     return 0;
 }
 //////////////////////////////////////////////////////////////////////
-template<class T> T BSpline<T>::evaluate(T x) {
+template<class T, class C> T BSpline<T, C>::evaluate(T x) {
     T y = 0;
-    if (OK) {
-        int n = (int)((x - xmin)/DX);
-        for (int i = my::max(0, n-1); i <= my::min(M, n+2); ++i) {
-            y += s->A[i] * Basis(i, x);
-        }
-        y += mean;
+    T t;
+    const T *p = polynomial(x, t);
+    if (p) {
+        y = p[0] + t * (p[1] + t * (p[2] + t * p[3]));
+    } else if (OK) {
+        y = basisSum(x, 0) + mean;
     }
     return y;
 }
 //////////////////////////////////////////////////////////////////////
-template<class T> T BSpline<T>::slope(T x) {
+template<class T, class C> T BSpline<T, C>::slope(T x) {
     T dy = 0;
-    if (OK) {
-        int n = (int)((x - xmin)/DX);
-        for (int i = my::max(0, n-1); i <= my::min(M, n+2); ++i) {
-            dy += s->A[i] * DBasis(i, x);
-        }
+    T t;
+    const T *p = polynomial(x, t);
+    if (p) {
+        dy = (p[1] + t * (2 * p[2] + t * 3 * p[3])) / DX;
+    } else if (OK) {
+        dy = basisSum(x, 1);
     }
     return dy;
 }
+//////////////////////////////////////////////////////////////////////
+/*
+ * Return the sum of the coefficients times the @p order-th derivative of
+ * the basis functions at x, without the mean.  The scalar methods use
+ * this wherever the kernels do not apply, which includes every x outside
+ * the domain for the array methods.
+ */
+template<class T, class C> C BSpline<T, C>::basisSum(T x, int order) {
+    C w[4];
+    int start = this->basisWeightsAt(x, w, order);
+    C sum = 0;
+    for (int m = 0; m < 4 && start+m <= M; ++m)
+        sum += s->A[start+m] * w[m];
+    return sum;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Fold the boundary conditions into coefficients for the virtual nodes
+ * just outside the domain, so that within the domain every node interval
+ * is the sum of four basis functions with the same closed form.
+ */
+template<class T, class C> void BSpline<T, C>::extendCoefficients() {
+    if (M < 3)
+        return;
+    std::vector<C> &A = s->A;
+    std::vector<T> &E = s->E;
+    E.resize(M+3);
+    E[0] = Beta(0) * A[0] + Beta(1) * A[1];
+    std::copy(A.begin(), A.begin() + M+1, E.begin() + 1);
+    E[M+2] = Beta(M-1) * A[M-1] + Beta(M) * A[M];
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> void BSpline<T, C>::evaluate(const T *x, int n,
+                                                      T *y) {
+    if (!OK || s->E.empty()) {
+        for (int i = 0; i < n; ++i)
+            y[i] = evaluate(x[i]);
+        return;
+    }
+    bspline_evaluate<0>(&s->E[0], M, xmin, (T)(1.0 / DX), (T)1, mean,
+                        x, n, y);
+
+    // The kernels clamp x to the domain, so evaluate the rest directly.
+    T xend = this->Xmax();
+    for (int i = 0; i < n; ++i) {
+        if (!(xmin <= x[i] && x[i] <= xend))
+            y[i] = evaluate(x[i]);
+    }
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> void BSpline<T, C>::slope(const T *x, int n, T *dy) {
+    if (!OK || s->E.empty()) {
+        for (int i = 0; i < n; ++i)
+            dy[i] = slope(x[i]);
+        return;
+    }
+    bspline_evaluate<1>(&s->E[0], M, xmin, (T)(1.0 / DX), (T)(1.0 / DX),
+                        (T)0, x, n, dy);
+
+    T xend = this->Xmax();
+    for (int i = 0; i < n; ++i) {
+        if (!(xmin <= x[i] && x[i] <= xend))
+            dy[i] = slope(x[i]);
+    }
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+void BSpline<T, C>::evaluateWithDerivatives(T x, T *y, T *dy, T *d2y) {
+    T v = 0;
+    T d = 0;
+    T d2 = 0;
+    T t;
+    const T *p = polynomial(x, t);
+    if (p) {
+        v = p[0] + t * (p[1] + t * (p[2] + t * p[3]));
+        d = (p[1] + t * (2 * p[2] + t * 3 * p[3])) / DX;
+        d2 = (2 * p[2] + t * 6 * p[3]) / (DX * DX);
+    } else if (OK && !s->E.empty() && xmin <= x && x <= this->Xmax()) {
+        bspline_derivatives_lanes<BSplineLane<T> >
+            (&s->E[0], M, xmin, (T)(1.0 / DX), mean, &x, 1, &v, &d, &d2);
+    } else if (OK) {
+        v = basisSum(x, 0) + mean;
+        d = basisSum(x, 1);
+        d2 = basisSum(x, 2);
+    }
+    if (y)
+        *y = v;
+    if (dy)
+        *dy = d;
+    if (d2y)
+        *d2y = d2;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+void BSpline<T, C>::evaluateWithDerivatives(const T *x, int n, T *y, T *dy,
+                                            T *d2y) {
+    if (!OK || s->E.empty()) {
+        for (int i = 0; i < n; ++i)
+            evaluateWithDerivatives(x[i], y+i, dy+i, d2y ? d2y+i : 0);
+        return;
+    }
+    bspline_derivatives(&s->E[0], M, xmin, (T)(1.0 / DX), mean,
+                        x, n, y, dy, d2y);
+
+    T xend = this->Xmax();
+    for (int i = 0; i < n; ++i) {
+        if (!(xmin <= x[i] && x[i] <= xend))
+            evaluateWithDerivatives(x[i], y+i, dy+i, d2y ? d2y+i : 0);
+    }
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> void BSpline<T, C>::evaluateGrid(T x0, T dx, int n,
+                                                            T *y, T *dy) {
+    if (!OK || s->E.empty()) {
+        for (int i = 0; i < n; ++i) {
+            T x = x0 + i * dx;
+            y[i] = evaluate(x);
+            if (dy)
+                dy[i] = slope(x);
+        }
+        return;
+    }
+
+    const T rdx = (T)(1.0 / DX);
+    const T xend = this->Xmax();
+    const bool table = s->usePolynomials && buildPolynomials();
+    T q[4] = { 0, 0, 0, 0 };
+    const T *p = q;
+    int k = -1;
+    for (int i = 0; i < n; ++i) {
+        T x = x0 + i * dx;
+        if (!(xmin <= x && x <= xend)) {
+            y[i] = evaluate(x);
+            if (dy)
+                dy[i] = slope(x);
+            continue;
+        }
+        T u = (x - xmin) * rdx;
+        int kx = my::min((int)u, M-1);
+        if (kx != k) {
+            // Entering a new node interval.
+            k = kx;
+            if (table) {
+                p = &s->Poly[4*k];
+            } else {
+                bspline_polynomial(&s->E[k], q);
+                q[0] += mean;
+            }
+        }
+        T t = u - k;
+        y[i] = p[0] + t * (p[1] + t * (p[2] + t * p[3]));
+        if (dy)
+            dy[i] = (p[1] + t * (2 * p[2] + t * 3 * p[3])) * rdx;
+    }
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Return the integral from xmin to @p x, which must be within the domain,
+ * of the curve without its mean and in units of the node interval.  The
+ * running integral at each node comes from the table, and the rest from
+ * the polynomial of the node interval containing x.
+ */
+template<class T, class C> double BSpline<T, C>::runningIntegral(T x) {
+    std::vector<double> &I = s->Integrals;
+    T p[4];
+    if (I.empty()) {
+        I.resize(M+1);
+        double sum = 0;
+        I[0] = 0;
+        for (int k = 0; k < M; ++k) {
+            bspline_polynomial(&s->E[k], p);
+            sum += p[0] + p[1] / 2.0 + p[2] / 3.0 + p[3] / 4.0;
+            I[k+1] = sum;
+        }
+    }
+    double u = ((double)x - xmin) / DX;
+    int k = my::min((int)u, M-1);
+    double t = u - k;
+    bspline_polynomial(&s->E[k], p);
+    return I[k] + t * (p[0] + t * (p[1] / 2.0 + t * (p[2] / 3.0 +
+                                                     t * p[3] / 4.0)));
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> T BSpline<T, C>::integral(T a, T b) {
+    if (!OK)
+        return 0;
+    double sign = 1;
+    if (b < a) {
+        std::swap(a, b);
+        sign = -1;
+    }
+    const T xend = this->Xmax();
+    a = my::max(a, xmin);
+    b = my::min(b, xend);
+    if (!(a < b))
+        return 0;
+
+    double sum = mean * ((double)b - a);
+    if (!s->E.empty()) {
+        sum += DX * (runningIntegral(b) - runningIntegral(a));
+    } else {
+        // Too few nodes for the extended coefficients, but the curve is
+        // still a cubic within each node interval, so two point
+        // Gauss-Legendre quadrature over each piece is exact.
+        const double g = 0.5 / std::sqrt(3.0);
+        for (int k = 0; k < M; ++k) {
+            double x0 = my::max((double)a, xmin + k * DX);
+            double x1 = my::min((double)b, xmin + (k+1) * DX);
+            if (!(x0 < x1))
+                continue;
+            double c = (x0 + x1) / 2;
+            double h = x1 - x0;
+            sum += h / 2 * (evaluate((T)(c - g * h)) +
+                            evaluate((T)(c + g * h)) - 2 * mean);
+        }
+    }
+    return (T)(sign * sum);
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> void BSpline<T, C>::integral(const T *a,
+                                                        const T *b, int n,
+                                                        T *result) {
+    for (int i = 0; i < n; ++i)
+        result[i] = integral(a[i], b[i]);
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Store the fitted values at points i0 through i1-1 of the domain into
+ * out[0] through out[i1-i0-1].
+ */
+template<class T, class C> void BSpline<T, C>::fitted(int i0, int i1,
+                                                      T *out) {
+    const C *A = &s->A[0];
+    int i, m;
+    if (!base->Start.empty()) {
+        const int *start = &base->Start[0];
+        const C *w = &base->Weights[4*(size_t)i0];
+        for (i = i0; i < i1; ++i, w += 4) {
+            const C *a = A + start[i];
+            out[i-i0] = a[0] * w[0] + a[1] * w[1] + a[2] * w[2] +
+                a[3] * w[3] + mean;
+        }
+        return;
+    }
+    const XArray<T> X = base->xvalues();
+    C w[4];
+    for (i = i0; i < i1; ++i) {
+        int start = basisWeights(X[i], w);
+        C sum = mean;
+        for (m = 0; m < 4 && start+m <= M; ++m)
+            sum += A[start+m] * w[m];
+        out[i-i0] = sum;
+    }
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> bool BSpline<T, C>::fittedValues(T *out) {
+    if (!OK)
+        return false;
+    fitted(0, NX, out);
+    return true;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+typename BSpline<T, C>::Residuals BSpline<T, C>::residualStats(const T *y) {
+    Residuals r;
+    r.rms = 0;
+    r.maxAbs = 0;
+    r.worst = -1;
+    if (!OK || NX == 0)
+        return r;
+
+    // Fit a block of points at a time into a small buffer.
+    const int BLOCK = 256;
+    T f[BLOCK];
+    double sum = 0;
+    for (int i0 = 0; i0 < NX; i0 += BLOCK) {
+        int i1 = my::min(NX, i0 + BLOCK);
+        fitted(i0, i1, f);
+        for (int i = i0; i < i1; ++i) {
+            double e = (double)y[i] - f[i-i0];
+            sum += e * e;
+            if (r.worst < 0 || my::abs(e) > r.maxAbs) {
+                r.maxAbs = my::abs(e);
+                r.worst = i;
+            }
+        }
+    }
+    r.rms = std::sqrt(sum / NX);
+    return r;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Build the bands of (P+Q)^-1 and the residual variance for variance().
+ * With a the coefficients and c = Pa + alpha*Qa the right-hand side, the
+ * weighted sum of squared residuals is yWy - a'Pa - 2*alpha*a'Qa, from
+ * the bands of P and Q, and the trace of the hat matrix is the trace of
+ * (P+Q)^-1 P, from the bands of the inverse.
+ */
+template<class T, class C> bool BSpline<T, C>::buildVariance() {
+    if (!OK)
+        return false;
+    if (!s->Inverse.empty())
+        return true;
+    const int N = M+1;
+    std::vector<C> z(4*(size_t)N);
+    if (!this->inverseBands(&z[0]))
+        return false;
+
+    // The removed mean is part of the hat matrix too, as in
+    // selectWavelength().  Points with no weight do not count.
+    std::vector<C> sw(N), v(N);
+    int n = 0;
+    double wsum = this->basisSums(0, C(), (C *)0, &sw[0], 1, 0, &n);
+    std::copy(sw.begin(), sw.end(), v.begin());
+    if (wsum <= 0 || !this->solveBanded(&v[0], 1))
+        return false;
+    double trace = this->hatTrace(&z[0], &sw[0], &v[0], 1, wsum);
+
+    const C *p = base->Pc.storage();
+    const C *q = base->Qc.storage();
+    const C *a = &s->A[0];
+    double apa = 0, aqa = 0;
+    for (int i = 0; i < N; ++i) {
+        const C *pi = p + 4*(size_t)i;
+        const C *qi = q + 4*(size_t)i;
+        apa += pi[0] * a[i] * a[i];
+        aqa += qi[0] * a[i] * a[i];
+        for (int k = 1; k < 4 && i+k < N; ++k) {
+            apa += 2 * pi[k] * a[i] * a[i+k];
+            aqa += 2 * qi[k] * a[i] * a[i+k];
+        }
+    }
+    double rss = my::max(0.0, s->yWy - apa - 2 * this->Alpha() * aqa);
+    s->residualVariance = (n > trace) ? rss / (n - trace) : 0;
+    s->Inverse.swap(z);
+    return true;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Return the variance at x, once buildVariance() has succeeded.
+ */
+template<class T, class C> double BSpline<T, C>::varianceAt(T x) {
+    // Outside the domain, the same basis functions as evaluate().
+    C w[4];
+    int m, n;
+    int start = this->basisWeightsAt(x, w);
+    double v = 0;
+    for (m = 0; m < 4 && start+m <= M; ++m) {
+        const C *zm = &s->Inverse[4*(size_t)(start+m)];
+        v += w[m] * w[m] * zm[0];
+        for (n = m+1; n < 4 && start+n <= M; ++n)
+            v += 2 * w[m] * w[n] * zm[n-m];
+    }
+    return s->residualVariance * v;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> T BSpline<T, C>::variance(T x) {
+    if (!buildVariance())
+        return 0;
+    return varianceAt(x);
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> void BSpline<T, C>::variance(const T *x, int n,
+                                                        T *var) {
+    if (!buildVariance()) {
+        std::fill(var, var + n, T());
+        return;
+    }
+    for (int i = 0; i < n; ++i)
+        var[i] = varianceAt(x[i]);
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> T BSpline<T, C>::residualVariance() {
+    return buildVariance() ? s->residualVariance : 0;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> bool BSpline<T, C>::cachePolynomials(int on) {
+    if (on >= 0) {
+        s->usePolynomials = (on > 0);
+        if (!s->usePolynomials)
+            std::vector<T>().swap(s->Poly);
+    }
+    return s->usePolynomials;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> bool BSpline<T, C>::buildPolynomials() {
+    if (!OK || s->E.empty())
+        return false;
+    s->usePolynomials = true;
+    if (s->Poly.empty()) {
+        s->Poly.resize(4*M);
+        for (int k = 0; k < M; ++k) {
+            bspline_polynomial(&s->E[k], &s->Poly[4*k]);
+            s->Poly[4*k] += mean;
+        }
+    }
+    return true;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Return the polynomial coefficients of the node interval containing @p
+ * x, and the position @p t of x within that interval, if the polynomial
+ * table is in use and x is inside the domain.  Otherwise return null.
+ */
+template<class T, class C> const T *BSpline<T, C>::polynomial(T x, T &t) {
+    if (!s->usePolynomials || !(xmin <= x && x <= this->Xmax()) ||
+        !buildPolynomials())
+        return 0;
+    T u = (x - xmin) / DX;
+    int k = my::min((int)u, M-1);
+    t = u - k;
+    return &s->Poly[4*k];
+}
@@ -20,7 +20,7 @@
 #include <BSpline/BSplineBase.h>
 #include <vector>
 
-template <class T> struct BSplineP;
+template <class T, class C> struct BSplineP;
 
 
 /**
@@ -29,8 +29,8 @@ template <class T> struct BSplineP;
  * smoothing.  See the BSplineBase documentation for a summary of the
  * BSpline interface.
  */
-template <class T>
-class BSPLINE_PUBLIC BSpline : public BSplineBase<T>
+template <class T, class C>
+class BSPLINE_PUBLIC BSpline : public BSplineBase<T, C>
 {
 public:
     /**
@@ -59,14 +59,32 @@ public:
     BSpline (const T *x, int nx, 		/* independent variable */
 	     const T *y,			/* dependent values @ ea X */
 	     double wl,				/* cutoff wavelength */
-	     int bc_type = BSplineBase<T>::BC_ZERO_SECOND,
+	     int bc_type = BSplineBase<T, C>::BC_ZERO_SECOND,
 	     int num_nodes = 0);
 
     /**
      * A BSpline curve can be derived from a separate @p base and a set
      * of data points @p y over that base.
      */
-    BSpline (BSplineBase<T> &base, const T *y);
+    BSpline (const BSplineBase<T, C> &base, const T *y);
+
+    /**
+     * Copy constructor.  The copy shares the domain of @p b, as for the
+     * BSplineBase copy constructor, and copies its coefficients.
+     */
+    BSpline (const BSpline &b);
+
+    /**
+     * Move constructor.  The domain and coefficients of @p b are taken
+     * over, leaving @p b empty and not ok().
+     */
+    BSpline (BSpline &&b);
+
+    /// Share the domain and copy the coefficients of @p b.
+    BSpline &operator= (const BSpline &b);
+
+    /// Take over the domain and coefficients of @p b.
+    BSpline &operator= (BSpline &&b);
 
     /**
      * Solve the spline curve for a new set of y values.  Returns false
@@ -89,6 +107,154 @@ public:
      */
     T slope (T x);
 
+    /**
+     * Evaluate the smoothed curve and its first and second derivatives
+     * at @p x together, storing them in @p y, @p dy, and @p d2y.  Any of
+     * the pointers may be null to skip that result.  The interval lookup
+     * and the coefficients are shared by all three, so this is cheaper
+     * than calling evaluate() and slope().  If the current state is not
+     * ok(), the results are zero.
+     */
+    void evaluateWithDerivatives (T x, T *y, T *dy, T *d2y = 0);
+
+    /**
+     * Evaluate the smoothed curve and its first and second derivatives
+     * at each of the @p n values in @p x, as with the array form of
+     * evaluate().  @p y and @p dy must hold @p n values, and @p d2y
+     * may be null to skip the second derivatives.
+     */
+    void evaluateWithDerivatives (const T *x, int n, T *y, T *dy,
+                                  T *d2y = 0);
+
+    /**
+     * Evaluate the smoothed curve at each of the @p n values in @p x and
+     * store the results in @p y.  The results are the same as calling
+     * evaluate() for each x, within rounding, but the basis weights are
+     * computed in closed form and the x values inside the domain are
+     * evaluated several at a time with vector instructions when they
+     * are available.  If the current state is not ok(), the results are
+     * zero.
+     */
+    void evaluate (const T *x, int n, T *y);
+
+    /**
+     * Store the first derivative of the spline curve at each of the @p n
+     * values in @p x into @p dy, as with the array form of evaluate().
+     */
+    void slope (const T *x, int n, T *dy);
+
+    /**
+     * Evaluate the smoothed curve on the regular grid of @p n points
+     * x0, x0 + dx, x0 + 2*dx, ..., storing the values in @p y and, if
+     * @p dy is not null, the first derivatives in @p dy.  Each node
+     * interval is converted once into the coefficients of its cubic
+     * polynomial, and the points within it are evaluated with Horner's
+     * rule, so there are no basis function evaluations or interval
+     * searches per point.  The results agree with evaluate() and slope()
+     * to within rounding error, relative to the magnitude of the
+     * coefficients: about 1e-12 for double and 1e-5 for float.  Points
+     * outside the domain are evaluated with evaluate() and slope().
+     */
+    void evaluateGrid (T x0, T dx, int n, T *y, T *dy = 0);
+
+    /**
+     * Call this method with a value greater than zero to evaluate the
+     * curve from a table of the cubic polynomial of each node interval,
+     * or with zero to go back to summing the basis functions.  Calling
+     * with no arguments returns true if the table is in use, else false.
+     *
+     * The table holds four coefficients per node interval, with the
+     * boundary conditions and the mean folded in, so evaluate() and
+     * slope() inside the domain become a table lookup and Horner's rule.
+     * The table is built by the first evaluation after each solve(), or
+     * right away by buildPolynomials().  The results agree with the
+     * basis function sums to within rounding, as for evaluateGrid().
+     */
+    bool cachePolynomials (int on = -1);
+
+    /**
+     * Build the table of interval polynomials now instead of on the
+     * first evaluation, and start using it as with cachePolynomials().
+     * Returns false if the current state is not ok() or the domain has
+     * too few nodes for the table.
+     */
+    bool buildPolynomials ();
+
+    /**
+     * Return the definite integral of the smoothed curve from @p a to @p
+     * b, which is negative if @p b is less than @p a.  Only the part of
+     * the interval within the domain, Xmin() to Xmax(), is integrated.
+     * The first integral after each solve() builds a table of the
+     * running integral at each node, so every integral costs two partial
+     * node intervals and a table lookup, whatever its length.  If the
+     * current state is not ok(), returns zero.
+     */
+    T integral (T a, T b);
+
+    /**
+     * Store the integral from a[i] to b[i] for each of the @p n pairs of
+     * limits into @p result, as with integral().
+     */
+    void integral (const T *a, const T *b, int n, T *result);
+
+    /**
+     * Store the value of the curve at each of the nX() x values of the
+     * domain into @p out.  The basis weights of the points come from the
+     * basis cache if the domain has one, else they are computed on the
+     * way, with no interval searches.  Returns false if the current
+     * state is not ok().
+     */
+    bool fittedValues (T *out);
+
+    /// The residuals of a curve from its data, from residualStats().
+    struct Residuals
+    {
+        T rms;          ///< Root mean square residual
+        T maxAbs;       ///< Largest absolute residual
+        int worst;      ///< Index of the point with the largest residual
+    };
+
+    /**
+     * Return the statistics of the residuals y[i] - f(x[i]) of the curve
+     * f from the @p y values it was solved for, computing the fitted
+     * values as in fittedValues() in one pass without storing them.  The
+     * residuals are not weighted.  If the current state is not ok(), the
+     * statistics are zero and worst is -1.
+     */
+    Residuals residualStats (const T *y);
+
+    /**
+     * Return the variance of the smoothed curve at @p x, whose square
+     * root is the width of a one-sigma band about the curve.  This is
+     * the Bayesian variance of a smoothing spline, s2 b'(P+Q)^-1 b, where
+     * b holds the basis functions at @p x and s2 is residualVariance().
+     * The first variance after each solve() finds the elements of
+     * (P+Q)^-1 within its bands by selected inversion of the factored
+     * P+Q, in O(M) operations, and each variance after that costs a
+     * few operations on at most four nodes.  The weights of the domain,
+     * if any, are taken as inverse variances relative to s2.  If the
+     * current state is not ok(), returns zero.
+     */
+    T variance (T x);
+
+    /**
+     * Store the variance of the smoothed curve at each of the @p n values
+     * in @p x into @p var, as with variance().
+     */
+    void variance (const T *x, int n, T *var);
+
+    /**
+     * Return the estimated variance of the y values about the curve:
+     * the weighted sum of the squared residuals, divided by the number
+     * of points with non-zero weight less the trace of the hat matrix,
+     * which maps the y values to the curve at each x.  The trace counts
+     * the mean removed from the y values, so it matches the degrees of
+     * freedom in selectWavelength().  Returns zero if the current state
+     * is not ok() or the curve has as many degrees of freedom as there
+     * are points.
+     */
+    T residualVariance ();
+
     /**
      * Return the @p n-th basis coefficient, from 0 to M.  If the current
      * state is not ok(), or @p n is out of range, the method returns zero.
@@ -97,22 +263,36 @@ public:
 
     virtual ~BSpline();
 
-    using BSplineBase<T>::Debug;
-    using BSplineBase<T>::Basis;
-    using BSplineBase<T>::DBasis;
+    using BSplineBase<T, C>::Debug;
+    using BSplineBase<T, C>::Basis;
+    using BSplineBase<T, C>::DBasis;
+    using BSplineBase<T, C>::D2Basis;
 
 protected:
 
-    using BSplineBase<T>::OK;
-    using BSplineBase<T>::M;
-    using BSplineBase<T>::NX;
-    using BSplineBase<T>::DX;
-    using BSplineBase<T>::base;
-    using BSplineBase<T>::xmin;
-    using BSplineBase<T>::xmax;
+    // A plan evaluates the coefficients directly.
+    friend class BSplineEvaluationPlan<T, C>;
+
+    using BSplineBase<T, C>::OK;
+    using BSplineBase<T, C>::M;
+    using BSplineBase<T, C>::NX;
+    using BSplineBase<T, C>::DX;
+    using BSplineBase<T, C>::base;
+    using BSplineBase<T, C>::xmin;
+    using BSplineBase<T, C>::xmax;
+    using BSplineBase<T, C>::Beta;
+    using BSplineBase<T, C>::basisWeights;
+
+    void extendCoefficients ();
+    C basisSum (T x, int order);
+    const T *polynomial (T x, T &t);
+    double runningIntegral (T x);
+    void fitted (int i0, int i1, T *out);
+    bool buildVariance ();
+    double varianceAt (T x);
 
     // Our hidden state structure
-    BSplineP<T> *s;
+    BSplineP<T, C> *s;
     T mean;			// Fit without mean and add it in later
 
 };
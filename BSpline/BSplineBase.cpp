@@ -15,6 +15,7 @@
 #include "BSpline.h"
 #include "BSplineVersion.h"
 #include "BandedMatrix.h"
+#include "BSplineKernels.h"
 
 #include <vector>
 #include <algorithm>
@@ -22,7 +23,10 @@
 #include <iostream>
 #include <iomanip>
 #include <map>
+#include <limits>
 #include <assert.h>
+#include <thread>
+#include <mutex>
 
 /*
  * This class simulates a namespace for private symbols used by this template
@@ -74,7 +78,8 @@ template<class T> class Matrix : public BandedMatrix<T>
 
         inline Matrix & operator=(const Matrix &b)
         {
-            return Copy(*this, b);
+            BandedMatrix<T>::operator= (b);
+            return *this;
         }
 
         inline Matrix & operator=(const T &e)
@@ -83,18 +88,87 @@ template<class T> class Matrix : public BandedMatrix<T>
             return *this;
         }
 
+        // Copy the upper bands of a symmetric matrix into its lower bands.
+        void symmetrize()
+        {
+            int N = this->num_rows();
+            int nb = my::min(-this->first_band(), this->last_band());
+            for (int i = 0; i < N; ++i)
+                for (int j = 1; j <= nb && i+j < N; ++j)
+                    this->band(i+j, i) = this->band(i, i+j);
+        }
+
     };
     //////////////////////////////////////////////////////////////////////
     // Our private state structure, which hides our use of some matrix
     // template classes.
 
-template<class T> struct BSplineBaseP
+/*
+ * The x values of a domain, which may be borrowed from the caller with any
+ * number of bytes between them.
+ */
+template<class T> class XArray
 {
-        typedef Matrix<T> MatrixT;
+    public:
+        XArray(const T *x, size_t stride = sizeof(T)) :
+            p((const char *)x), stride(stride) {}
+
+        const T &operator[](size_t i) const
+        {
+            return *(const T *)(p + i * stride);
+        }
+
+        // Return the values as an array if they are contiguous, else null.
+        const T *contiguous() const
+        {
+            return (stride == sizeof(T)) ? (const T *)p : 0;
+        }
+
+    private:
+        const char *p;
+        size_t stride;
+};
+
+template<class T, class C> struct BSplineBaseP
+{
+        typedef Matrix<C> MatrixT;
+
+        BSplineBaseP() : laidOut(false), XB(0), XStride(sizeof(T)) {}
+
+        MatrixT Q; // Holds P+Q and its factorization, all bands for
+                   // the LU solver, only the upper bands for LDL'
+        MatrixT Qc; // The upper bands of Q without alpha, and of P,
+        MatrixT Pc; // so P+Q can be assembled again for a new alpha,
+                    // new weights, or a new solver
+
+        // For SOLVER_PARTITIONED, the first of the three rows of each
+        // separator between the interior blocks of Q, and the factored
+        // system for the separator nodes.
+        std::vector<int> Separators;
+        MatrixT S;
+
+        bool laidOut; // Setup() succeeded for these X
 
-        MatrixT Q; // Holds P+Q and its factorization
+        // The x values are either copied into X, or borrowed from the
+        // caller at XB, XStride bytes apart.
         std::vector<T> X;
+        const T *XB;
+        size_t XStride;
+
+        XArray<T> xvalues() const
+        {
+            return XB ? XArray<T>(XB, XStride) : XArray<T>(X.data());
+        }
+
         std::vector<T> Nodes;
+
+        // Optional weight of each X, empty for equal weights.
+        std::vector<T> W;
+
+        // Optional cache of the basis weights at each X[i]: the first of
+        // four consecutive nodes and the weight of each of those nodes.
+        std::vector<int> Start;
+        std::vector<C> Weights;
 };
 
 //////////////////////////////////////////////////////////////////////
@@ -103,7 +177,8 @@ template<class T> struct BSplineBaseP
 // constraints.  The boundary condition type--0, 1, or 2--is the first
 // index into the array, followed by the index of the endpoints.  See the
 // Beta() method.
-template<class T> const double BSplineBase<T>::BoundaryConditions[3][4] =
+template<class T, class C>
+const double BSplineBase<T, C>::BoundaryConditions[3][4] =
     {
             //  0       1       M-1     M
                 {
@@ -122,7 +197,7 @@ template<class T> const double BSplineBase<T>::BoundaryConditions[3][4] =
                         -1,
                         2 } };
 //////////////////////////////////////////////////////////////////////
-template<class T> inline bool BSplineBase<T>::Debug(int on)
+template<class T, class C> inline bool BSplineBase<T, C>::Debug(int on)
 {
     static bool debug = false;
     if (on >= 0)
@@ -131,10 +206,10 @@ template<class T> inline bool BSplineBase<T>::Debug(int on)
 }
 
 //////////////////////////////////////////////////////////////////////
-template<class T> const double BSplineBase<T>::PI = 3.1415927;
+template<class T, class C> const double BSplineBase<T, C>::PI = 3.1415927;
 
 //////////////////////////////////////////////////////////////////////
-template<class T> const char * BSplineBase<T>::Version()
+template<class T, class C> const char * BSplineBase<T, C>::Version()
 {
     return (BSPLINE_VERSION);
 }
@@ -143,58 +218,190 @@ template<class T> const char * BSplineBase<T>::Version()
 // Construction/Destruction
 //////////////////////////////////////////////////////////////////////
 
-template<class T> BSplineBase<T>::~BSplineBase()
+template<class T, class C> BSplineBase<T, C>::~BSplineBase()
 {
-    delete base;
 }
 
-// This is a member-wise copy except for replacing our
-// private base structure with the source's, rather than just copying
-// the pointer.  But we use the compiler's default copy constructor for
-// constructing our BSplineBaseP.
-template<class T> BSplineBase<T>::BSplineBase(const BSplineBase<T> &bb) :
-    K(bb.K), BC(bb.BC), OK(bb.OK), base(new BSplineBaseP<T>(*bb.base))
+// The copy shares the source's private base structure, which is only
+// ever changed by a BSplineBase which holds the only reference to it.
+// See detach().
+template<class T, class C>
+BSplineBase<T, C>::BSplineBase(const BSplineBase<T, C> &bb) :
+    base(bb.base)
+{
+    copyState(bb);
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+BSplineBase<T, C>::BSplineBase(BSplineBase<T, C> &&bb) :
+    base(std::move(bb.base))
+{
+    copyState(bb);
+    bb.clearState();
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+BSplineBase<T, C> &BSplineBase<T, C>::operator=(const BSplineBase<T, C> &bb)
+{
+    if (this != &bb) {
+        base = bb.base;
+        copyState(bb);
+    }
+    return *this;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+BSplineBase<T, C> &BSplineBase<T, C>::operator=(BSplineBase<T, C> &&bb)
+{
+    if (this != &bb) {
+        base = std::move(bb.base);
+        copyState(bb);
+        bb.clearState();
+    }
+    return *this;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Copy the members other than the private base structure.
+ */
+template<class T, class C>
+void BSplineBase<T, C>::copyState(const BSplineBase<T, C> &bb)
 {
-    xmin = bb.xmin;
-    xmax = bb.xmax;
-    alpha = bb.alpha;
     waveLength = bb.waveLength;
-    DX = bb.DX;
+    NX = bb.NX;
+    K = bb.K;
+    BC = bb.BC;
+    xmax = bb.xmax;
+    xmin = bb.xmin;
     M = bb.M;
-    NX = base->X.size();
+    DX = bb.DX;
+    alpha = bb.alpha;
+    OK = bb.OK;
+    basisCache = bb.basisCache;
+    solverType = bb.solverType;
+    nThreads = bb.nThreads;
+    deterministic = bb.deterministic;
+    executor = bb.executor;
 }
 //////////////////////////////////////////////////////////////////////
-template<class T> BSplineBase<T>::BSplineBase(const T *x,
-                                              int nx,
-                                              double wl,
-                                              int bc,
-                                              int num_nodes) :
-    NX(0), K(2), OK(false), base(new BSplineBaseP<T>)
+/*
+ * Leave this object as an empty domain, after its base structure has
+ * been moved to another.
+ */
+template<class T, class C> void BSplineBase<T, C>::clearState()
+{
+    base = std::make_shared<BSplineBaseP<T, C> >();
+    NX = 0;
+    M = 0;
+    OK = false;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Give this object its own copy of the private base structure before
+ * changing it, if the structure is shared with other objects.
+ */
+template<class T, class C> void BSplineBase<T, C>::detach()
+{
+    if (base.use_count() > 1)
+        base = std::make_shared<BSplineBaseP<T, C> >(*base);
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> BSplineBase<T, C>::BSplineBase(const T *x,
+                                                          int nx,
+                                                          double wl,
+                                                          int bc,
+                                                          int num_nodes) :
+    NX(0), K(2), OK(false), basisCache(false), solverType(SOLVER_LU),
+    nThreads(1), deterministic(false),
+    base(std::make_shared<BSplineBaseP<T, C> >())
 {
     setDomain(x, nx, wl, bc, num_nodes);
 }
+//////////////////////////////////////////////////////////////////////
+/*
+ * Construct an empty domain, for setDomain() or borrowDomain() later, or
+ * for subclasses which lay out their own nodes.
+ */
+template<class T, class C> BSplineBase<T, C>::BSplineBase() :
+    waveLength(0), NX(0), K(2), BC(BC_ZERO_SECOND), xmax(0), xmin(0),
+    M(0), DX(1), alpha(0), OK(false), basisCache(false),
+    solverType(SOLVER_LU), nThreads(1), deterministic(false),
+    base(std::make_shared<BSplineBaseP<T, C> >())
+{
+}
 
 //////////////////////////////////////////////////////////////////////
 // Methods
-template<class T> bool BSplineBase<T>::setDomain(const T *x,
-                                                 int nx,
-                                                 double wl,
-                                                 int bc,
-                                                 int num_nodes) 
+template<class T, class C> bool BSplineBase<T, C>::setDomain(const T *x,
+                                                             int nx,
+                                                             double wl,
+                                                             int bc,
+                                                             int num_nodes,
+                                                             const T *weights)
+{
+    return layOut(x, nx, sizeof(T), false, wl, bc, num_nodes, weights);
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> bool BSplineBase<T, C>::borrowDomain(const T *x,
+                                                                int nx,
+                                                                double wl,
+                                                                int bc,
+                                                                int num_nodes,
+                                                                const T *weights,
+                                                                size_t stride)
+{
+    if (stride < sizeof(T) || stride % alignof(T) != 0)
+        return false;
+    return layOut(x, nx, stride, true, wl, bc, num_nodes, weights);
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Set up the domain for setDomain() and borrowDomain().
+ */
+template<class T, class C> bool BSplineBase<T, C>::layOut(const T *x,
+                                                          int nx,
+                                                          size_t stride,
+                                                          bool borrow,
+                                                          double wl,
+                                                          int bc,
+                                                          int num_nodes,
+                                                          const T *weights)
 {
     if ((nx <= 0) || (x == 0) || (wl< 0) || (bc< 0) || (bc> 2)) {
         return false;
     }
     OK = false;
+    // Everything in the base structure is set up again, so a shared one
+    // can be left to its other owners without copying it.
+    if (base.use_count() > 1)
+        base = std::make_shared<BSplineBaseP<T, C> >();
+    base->laidOut = false;
+    base->Start.clear();
+    base->Weights.clear();
+    base->Nodes.clear();
+    if (weights)
+        base->W.assign(weights, weights+nx);
+    else
+        base->W.clear();
     waveLength = wl;
     BC = bc;
-    // Copy the x array into our storage.
-    base->X.resize(nx);
-    std::copy(x, x+nx, base->X.begin());
-    NX = base->X.size();
+    if (borrow) {
+        // Release any copy from an earlier domain.
+        std::vector<T>().swap(base->X);
+        base->XB = x;
+        base->XStride = stride;
+    } else {
+        // Copy the x array into our storage.
+        base->X.assign(x, x+nx);
+        base->XB = 0;
+        base->XStride = sizeof(T);
+    }
+    NX = nx;
 
     // The Setup() method determines the number and size of node intervals.
     if (Setup(num_nodes)) {
+        base->laidOut = true;
+        nodes(0);
         if (Debug()) {
             std::cerr << "Using M node intervals: " << M << " of length DX: "
                     << DX << std::endl;
@@ -218,12 +425,13 @@ template<class T> bool BSplineBase<T>::setDomain(const T *x,
             std::cerr.fill(' ');
             std::cerr.precision(2);
             std::cerr.width(5);
-            std::cerr << base->Q << std::endl;
+            std::cerr << base->Qc << std::endl;
         }
 
         if (Debug())
             std::cerr << "Calculating P..." << std::endl;
         addP();
+        assemble();
         if (Debug()) {
             std::cerr << "Done." << std::endl;
             if (M < 30) {
@@ -250,7 +458,7 @@ template<class T> bool BSplineBase<T>::setDomain(const T *x,
 /*
  * Calculate the alpha parameter given a wavelength.
  */
-template<class T> double BSplineBase<T>::Alpha(double wl)
+template<class T, class C> double BSplineBase<T, C>::Alpha(double wl) const
 {
     // K is the degree of the derivative constraint: 1, 2, or 3
     double a = (double) (wl / (2 * PI * DX));
@@ -266,7 +474,7 @@ template<class T> double BSplineBase<T>::Alpha(double wl)
  * Return the correct beta value given the node index.  The value depends
  * on the node index and the current boundary condition type.
  */
-template<class T> inline double BSplineBase<T>::Beta(int m)
+template<class T, class C> inline double BSplineBase<T, C>::Beta(int m) const
 {
     if (m > 1 && m < M-1)
         return 0.0;
@@ -277,22 +485,316 @@ template<class T> inline double BSplineBase<T>::Beta(int m)
     return BoundaryConditions[BC][m];
 }
 //////////////////////////////////////////////////////////////////////
+template<class T, class C> bool BSplineBase<T, C>::cacheBasis(int on)
+{
+    if (on >= 0) {
+        basisCache = (on > 0);
+        if (basisCache == base->Start.empty())
+            detach();
+        if (!basisCache) {
+            std::vector<int>().swap(base->Start);
+            std::vector<C>().swap(base->Weights);
+        } else if (OK && base->Start.empty()) {
+            addWeights();
+        }
+    }
+    return !base->Start.empty();
+}
+//////////////////////////////////////////////////////////////////////
 /*
  * Given an array of y data points defined over the domain
  * of x data points in this BSplineBase, create a BSpline
  * object which contains the smoothed curve for the y array.
  */
-template<class T> BSpline<T> * BSplineBase<T>::apply(const T *y)
+template<class T, class C>
+BSpline<T, C> * BSplineBase<T, C>::apply(const T *y) const
+{
+    return new BSpline<T, C> (*this, y);
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Solve for the coefficients of several channels of y values over this
+ * domain.  The B vectors are interleaved by node, B[m*nchannels + c], so
+ * the basis functions are evaluated once per x and the substitution
+ * through the banded LU factors runs across all channels together.
+ */
+template<class T, class C> bool BSplineBase<T, C>::solveMany(const T *y,
+                                                             int nchannels,
+                                                             int stride,
+                                                             T *coeffs,
+                                                             T *means) const
+{
+    if (!OK || y == 0 || coeffs == 0 || nchannels <= 0 || stride < NX)
+        return false;
+
+    // Remove the mean of each channel, as in BSpline::solve().
+    std::vector<T> mean(nchannels);
+    int c, j, m;
+    for (c = 0; c < nchannels; ++c)
+        mean[c] = dataMean(y + (size_t)c * stride);
+
+    const T *W = base->W.empty() ? 0 : &base->W[0];
+    const XArray<T> X = base->xvalues();
+    std::vector<C> B((size_t)(M+1) * nchannels, C());
+    std::vector<C> yj(nchannels);
+    for (j = 0; j < NX; ++j) {
+        C wj = W ? W[j] : 1;
+        for (c = 0; c < nchannels; ++c)
+            yj[c] = (y[(size_t)c * stride + j] - mean[c]) * wj;
+
+        if (!base->Start.empty()) {
+            // Gather from the cached basis weights.
+            const C *w = &base->Weights[4*j];
+            for (m = 0; m < 4; ++m) {
+                C *Bm = &B[(size_t)(base->Start[j] + m) * nchannels];
+                for (c = 0; c < nchannels; ++c)
+                    Bm[c] += yj[c] * w[m];
+            }
+            continue;
+        }
+
+        C w[4];
+        int start = basisWeights(X[j], w);
+        for (m = 0; m < 4 && start+m <= M; ++m) {
+            C *Bm = &B[(size_t)(start + m) * nchannels];
+            for (c = 0; c < nchannels; ++c)
+                Bm[c] += yj[c] * w[m];
+        }
+    }
+
+    if (!solveBanded(&B[0], nchannels))
+        return false;
+
+    for (c = 0; c < nchannels; ++c) {
+        T *ac = coeffs + (size_t)c * (M+1);
+        for (m = 0; m <= M; ++m)
+            ac[m] = B[(size_t)m * nchannels + c];
+        if (means)
+            means[c] = mean[c];
+    }
+    return true;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Return the mean of the y values over this domain, weighted by the
+ * weight of each point if there are weights.
+ */
+template<class T, class C> C BSplineBase<T, C>::dataMean(const T *y) const
+{
+    C sum = 0.0;
+    int j;
+    if (base->W.empty()) {
+        for (j = 0; j < NX; ++j)
+            sum += y[j];
+        return sum / (double)NX;
+    }
+    C wsum = 0.0;
+    for (j = 0; j < NX; ++j) {
+        sum += base->W[j] * y[j];
+        wsum += base->W[j];
+    }
+    return (wsum != 0) ? sum / wsum : C();
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Score each candidate wavelength over the nodes of this domain.  With
+ * the y values less their mean as r, the weights as W, and the basis
+ * weights of each x as the rows of B, the right-hand side is c = B'Wr and
+ * the coefficients are a = (P+aQ)^-1 c, where P = B'WB.  The weighted sum
+ * of squared residuals is r'Wr - a'c - a*a'Qa, which needs only c and the
+ * bands of P and Q, so it is computed without another pass over the x
+ * values.  Removing the mean adds one to the trace of the hat matrix and
+ * subtracts s'(P+aQ)^-1 s / sum(W), where s = B'W1.  P and Q come from
+ * the bands kept for setWavelength().
+ *
+ * The scoring is done in double precision whatever the compute type.
+ */
+template<class T, class C>
+bool BSplineBase<T, C>::selectWavelength(const T *y,
+                                         const double *wavelengths,
+                                         int n,
+                                         double *best,
+                                         double *scores,
+                                         int criterion) const
+{
+    if (!OK || y == 0 || wavelengths == 0 || n <= 0 || best == 0 ||
+        (criterion != SELECT_GCV && criterion != SELECT_LOO))
+        return false;
+
+    const int N = M+1;
+    const T *W = base->W.empty() ? 0 : &base->W[0];
+    const XArray<T> X = base->xvalues();
+    const C mean = dataMean(y);
+    int i, j, k, m;
+
+    // The right-hand sides c and s interleaved, and the sums over the
+    // points, in one pass.
+    std::vector<double> cs(2*N, 0.0);
+    double rwr = 0;
+    int npoints = 0;
+    double wsum = basisSums(y, mean, &cs[0], &cs[1], 2, &rwr, &npoints);
+    if (wsum <= 0)
+        return false;
+
+    // The upper bands of P, and of Q without alpha, in rows of four.
+    const C *pc = base->Pc.storage();
+    const C *qc = base->Qc.storage();
+    std::vector<double> p(pc, pc + 4*(size_t)N);
+    std::vector<double> q(qc, qc + 4*(size_t)N);
+    C w[4];
+
+    const double inf = std::numeric_limits<double>::infinity();
+    std::vector<double> z(4*(size_t)N), v(3), ab(2*N);
+    int chosen = -1;
+    double low = inf;
+    for (int c = 0; c < n; ++c) {
+        double score = inf;
+        double a = Alpha(wavelengths[c]);
+        for (i = 0; i < 4*N; ++i)
+            z[i] = p[i] + a * q[i];
+        bool factored = true;
+        for (i = 0; i < N && factored; ++i)
+            factored = (LDLT_factor_banded_row(&z[0], 4, N, i, 3,
+                                               &v[0]) == 0);
+        std::copy(cs.begin(), cs.end(), ab.begin());
+        if (factored &&
+            LDLT_solve_banded_many_rows(&z[0], 4, N, &ab[0], 2, 3) == 0 &&
+            LDLT_inverse_banded_rows(&z[0], 4, N, 3) == 0) {
+            // z now holds the bands of (P+aQ)^-1, and ab the
+            // coefficients interleaved with (P+aQ)^-1 s.
+            double trace = hatTrace(&z[0], &cs[1], &ab[1], 2, wsum);
+            double rss = rwr, ac = 0, aqa = 0;
+            for (i = 0; i < N; ++i) {
+                const double *qi = &q[4*(size_t)i];
+                double ai = ab[2*i];
+                aqa += qi[0] * ai * ai;
+                for (k = 1; k < 4 && i+k < N; ++k)
+                    aqa += 2 * qi[k] * ai * ab[2*(i+k)];
+                ac += ai * cs[2*i];
+            }
+            rss -= ac + a * aqa;
+            if (rss < 0)
+                rss = 0;
+
+            if (criterion == SELECT_GCV) {
+                if (trace < npoints)
+                    score = npoints * rss /
+                        ((npoints - trace) * (npoints - trace));
+            } else {
+                // Divide each residual by one less the leverage of its
+                // point, from the bands of (P+aQ)^-1.
+                double sum = 0;
+                for (j = 0; j < NX && sum < inf; ++j) {
+                    double wj = W ? W[j] : 1;
+                    if (wj == 0)
+                        continue;
+                    int start = basisWeights(X[j], w);
+                    double f = 0, bzb = 0, bv = 0;
+                    for (m = 0; m < 4 && start+m <= M; ++m) {
+                        int r = start+m;
+                        f += w[m] * ab[2*r];
+                        bv += w[m] * ab[2*r+1];
+                        bzb += w[m] * w[m] * z[4*(size_t)r];
+                        for (k = m+1; k < 4 && start+k <= M; ++k)
+                            bzb += 2 * w[m] * w[k] * z[4*(size_t)r + k-m];
+                    }
+                    double h = wj * (bzb - bv / wsum + 1 / wsum);
+                    double e = (double)(y[j] - mean) - f;
+                    sum = (h < 1) ? sum + wj * (e/(1-h)) * (e/(1-h)) : inf;
+                }
+                score = sum / wsum;
+            }
+        }
+        if (scores)
+            scores[c] = score;
+        if (score < low) {
+            low = score;
+            chosen = c;
+        }
+    }
+    if (chosen < 0)
+        return false;
+    *best = wavelengths[chosen];
+    return true;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Add s = B'W1 into s[m*inc] over the points with non-zero weight, and
+ * return the sum of their weights and their number in @p npoints.  If
+ * @p y is not null, also add c = B'Wr into c[m*inc], with r the y values
+ * less @p mean, and store r'Wr in @p rwr.  The basis weights come from
+ * the cache if there is one.
+ */
+template<class T, class C> template<class D>
+double BSplineBase<T, C>::basisSums(const T *y, C mean, D *c, D *s, int inc,
+                                    double *rwr, int *npoints) const
 {
-    return new BSpline<T> (*this, y);
+    const T *W = base->W.empty() ? 0 : &base->W[0];
+    const XArray<T> X = base->xvalues();
+    const int *cached = base->Start.empty() ? 0 : &base->Start[0];
+    double wsum = 0, rr = 0;
+    int count = 0;
+    C b[4];
+    for (int j = 0; j < NX; ++j) {
+        double wj = W ? W[j] : 1;
+        if (wj == 0)
+            continue;
+        const C *w = b;
+        int start;
+        if (cached) {
+            start = cached[j];
+            w = &base->Weights[4*(size_t)j];
+        } else {
+            start = basisWeights(X[j], b);
+        }
+        double rj = y ? (double)(y[j] - mean) : 0;
+        rr += wj * rj * rj;
+        wsum += wj;
+        ++count;
+        for (int m = 0; m < 4 && start+m <= M; ++m) {
+            s[(start+m)*inc] += wj * w[m];
+            if (y)
+                c[(start+m)*inc] += wj * rj * w[m];
+        }
+    }
+    if (rwr)
+        *rwr = rr;
+    if (npoints)
+        *npoints = count;
+    return wsum;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Return the trace of the hat matrix, which maps the y values to the
+ * curve at each x, given the bands @p z of (P+aQ)^-1 in rows of four,
+ * s = B'W1 in s[m*inc], (P+aQ)^-1 s in v[m*inc], and the sum of the
+ * weights.  That is 1 + tr((P+aQ)^-1 P) - s'(P+aQ)^-1 s / sum(W), where
+ * the first and last terms count the mean removed from the y values.
+ */
+template<class T, class C> template<class D>
+double BSplineBase<T, C>::hatTrace(const D *z, const D *s, const D *v,
+                                   int inc, double wsum) const
+{
+    const C *p = base->Pc.storage();
+    const int N = M+1;
+    double trace = 1, svs = 0;
+    for (int i = 0; i < N; ++i) {
+        const D *zi = z + 4*(size_t)i;
+        const C *pi = p + 4*(size_t)i;
+        trace += zi[0] * pi[0];
+        for (int k = 1; k < 4 && i+k < N; ++k)
+            trace += 2 * zi[k] * pi[k];
+        svs += s[i*inc] * v[i*inc];
+    }
+    return trace - svs / wsum;
 }
 //////////////////////////////////////////////////////////////////////
 /*
  * Evaluate the closed basis function at node m for value x,
  * using the parameters for the current boundary conditions.
  */
-template<class T> double BSplineBase<T>::Basis(int m,
-                                               T x)
+template<class T, class C> double BSplineBase<T, C>::Basis(int m,
+                                                           T x) const
 {
     double y = 0;
     double xm = xmin + (m * DX);
@@ -318,8 +820,8 @@ template<class T> double BSplineBase<T>::Basis(int m,
  * Evaluate the deriviative of the closed basis function at node m for
  * value x, using the parameters for the current boundary conditions.
  */
-template<class T> double BSplineBase<T>::DBasis(int m,
-                                                T x)
+template<class T, class C> double BSplineBase<T, C>::DBasis(int m,
+                                                            T x) const
 {
     double dy = 0;
     double xm = xmin + (m * DX);
@@ -345,8 +847,115 @@ template<class T> double BSplineBase<T>::DBasis(int m,
     return dy;
 }
 //////////////////////////////////////////////////////////////////////
-template<class T> double BSplineBase<T>::qDelta(int m1,
-                                                int m2)
+/*
+ * Evaluate the second deriviative of the closed basis function at node m
+ * for value x, using the parameters for the current boundary conditions.
+ */
+template<class T, class C> double BSplineBase<T, C>::D2Basis(int m,
+                                                             T x) const
+{
+    double d2y = 0;
+    double xm = xmin + (m * DX);
+    double z = my::abs((double)(x - xm) / (double)DX);
+    if (z < 2.0) {
+        z = 2.0 - z;
+        d2y = 1.5 * z;
+        z -= 1.0;
+
+        if (z > 0) {
+            d2y -= 6.0 * z;
+        }
+        d2y /= DX * DX;
+    }
+
+    // Boundary conditions, if any, are an additional addend.
+    if (m == 0 || m == 1)
+        d2y += Beta(m) * D2Basis(-1, x);
+    else if (m == M-1 || m == M)
+        d2y += Beta(m) * D2Basis(M+1, x);
+
+    return d2y;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Compute the weights w[0] through w[3] of the basis functions at x for
+ * four consecutive nodes, and return the first of those nodes.  Within
+ * the domain every node interval has the same four cubic weights, so
+ * only the first and last intervals fold the virtual nodes outside the
+ * domain into their neighbors with the boundary conditions, as Basis()
+ * does one node at a time.  With fewer than four nodes this falls back
+ * to Basis(), and the weights past node M are zero.
+ */
+template<class T, class C> int BSplineBase<T, C>::basisWeights(T x,
+                                                                C *w) const
+{
+    if (M < 3) {
+        for (int m = 0; m < 4; ++m)
+            w[m] = (m <= M) ? Basis(m, x) : 0;
+        return 0;
+    }
+
+    // The weights of nodes k-1 through k+2 for node interval k.
+    double u = ((double)x - xmin) / DX;
+    int k = my::max(0, my::min((int)u, M-1));
+    double b[4];
+    BSplineWeights<BSplineLane<double>, 0>::get(u - k, b);
+    if (k == 0) {
+        w[0] = b[1] + Beta(0) * b[0];
+        w[1] = b[2] + Beta(1) * b[0];
+        w[2] = b[3];
+        w[3] = 0;
+        return 0;
+    }
+    if (k == M-1) {
+        w[0] = 0;
+        w[1] = b[0];
+        w[2] = b[1] + Beta(M-1) * b[3];
+        w[3] = b[2] + Beta(M) * b[3];
+        return M-3;
+    }
+    w[0] = b[0];
+    w[1] = b[1];
+    w[2] = b[2];
+    w[3] = b[3];
+    return k-1;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Store the weights of the @p order-th derivative, 0 to 2, of the four
+ * basis functions starting at the returned node into @p w, for any x.
+ * Within the domain the values are those of basisWeights().  Outside of
+ * it, only the nodes which reach the interval of x count, as in
+ * BSpline::evaluate(), and the weights of the others are zero.
+ */
+template<class T, class C> int BSplineBase<T, C>::basisWeightsAt(T x,
+                                                                  C *w,
+                                                                  int order)
+    const
+{
+    if (order == 0 && xmin <= x && x <= Xmax())
+        return basisWeights(x, w);
+
+    int k = (int)((x - xmin) / DX);
+    int lo = my::max(0, k-1);
+    int hi = my::min(M, k+2);
+    int start = my::max(0, my::min(k-1, M-3));
+    for (int m = 0; m < 4; ++m) {
+        int n = start + m;
+        if (n < lo || n > hi)
+            w[m] = 0;
+        else if (order == 0)
+            w[m] = Basis(n, x);
+        else if (order == 1)
+            w[m] = DBasis(n, x);
+        else
+            w[m] = D2Basis(n, x);
+    }
+    return start;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> double BSplineBase<T, C>::qDelta(int m1,
+                                                            int m2) const
 /*
  * Return the integral of the product of the basis function derivative
  * restricted to the node domain, 0 to M.
@@ -431,97 +1040,327 @@ template<class T> double BSplineBase<T>::qDelta(int m1,
     double q = 0;
     for (int m = my::max(m1-2, 0); m < my::min(m1+2, M); ++m)
         q += qparts[K-1][m2-m1][m-m1+2];
-    return q * alpha;
+    return q;
 }
 //////////////////////////////////////////////////////////////////////
-template<class T> void BSplineBase<T>::calculateQ()
+/*
+ * Compute the upper bands of Q without alpha into Qc.  Q depends only
+ * on the nodes and the boundary conditions, so it is kept for any alpha.
+ */
+template<class T, class C> void BSplineBase<T, C>::calculateQ()
 {
-    Matrix<T> &Q = base->Q;
-    Q.setup(M+1, 3);
+    Matrix<C> &Q = base->Qc;
+    Q.setup(M+1, 0, 3);
     Q = 0;
-    if (alpha == 0)
-        return;
+    C *a = Q.storage();  // a[i*4 + j-i] is Q(i,j)
 
-    // First fill in the q values without the boundary constraints.
-    int i;
-    for (i = 0; i <= M; ++i) {
-        Q[i][i] = qDelta(i, i);
-        for (int j = 1; j < 4 && i+j <= M; ++j) {
-            Q[i][i+j] = Q[i+j][i] = qDelta(i, i+j);
+    // Rows 2 through M-5 reach neither the ends of the domain nor the
+    // boundary constraints, so they all equal the same stencil, and
+    // only the rows in the corners need qRow().
+    int lo = M+1, hi = M+1;
+    C q[4];
+    if (M >= 7) {
+        lo = 2;
+        hi = M-4;
+        qRow(lo, q);
+        for (int i = lo; i < hi; ++i) {
+            C *row = a + (size_t)i*4;
+            row[0] = q[0];
+            row[1] = q[1];
+            row[2] = q[2];
+            row[3] = q[3];
         }
     }
+    for (int i = 0; i <= M; ++i) {
+        if (i == lo)
+            i = hi;
+        qRow(i, q);
+        for (int j = 0; j < 4 && i+j <= M; ++j)
+            a[(size_t)i*4 + j] = q[j];
+    }
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Assemble P + alpha*Q into the matrix for the current solver, from the
+ * upper bands kept in Pc and Qc.  P and Q are symmetric, so only the
+ * diagonal and the upper bands are assembled.  factor() fills in the
+ * lower bands if the solver needs them.
+ */
+template<class T, class C> void BSplineBase<T, C>::assemble()
+{
+    Matrix<C> &A = base->Q;
+    if (solverType != SOLVER_LU)
+        A.setup(M+1, 0, 3);
+    else
+        A.setup(M+1, 3);
+    A = 0;
+    C *a = A.storage() - A.first_band();  // a[i*ld + j-i] is A(i,j)
+    const int ld = A.row_width();
+    const C *p = base->Pc.storage();
+    const C *q = base->Qc.storage();
+    const C ca = alpha;
+    for (int i = 0; i <= M; ++i) {
+        C *row = a + (size_t)i*ld;
+        for (int j = 0; j < 4 && i+j <= M; ++j)
+            row[j] = p[4*(size_t)i + j] + ca * q[4*(size_t)i + j];
+    }
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Compute the upper bands of row i of Q without alpha, q[j] = Q(i, i+j)
+ * for j from 0 to 3, including the boundary constraints.  Elements past
+ * node M are zero.
+ */
+template<class T, class C> void BSplineBase<T, C>::qRow(int i, C *q) const
+{
+    C b1, b2, c;
+    for (int j = 0; j < 4; ++j) {
+        int n = i+j;
+        q[j] = 0;
+        if (n > M)
+            continue;
+
+        // First the q value without the boundary constraints.
+        q[j] = qDelta(i, n);
 
-    // Now add the boundary constraints:
-    // First the upper left corner.
-    float b1, b2, q;
-    for (i = 0; i <= 1; ++i) {
-        b1 = Beta(i);
-        for (int j = i; j < i+4; ++j) {
-            b2 = Beta(j);
-            assert(j-i >= 0 && j - i < 4);
-            q = 0.0;
+        // Then the boundary constraints in the upper left corner...
+        if (i <= 1) {
+            b1 = Beta(i);
+            b2 = Beta(n);
+            c = 0.0;
             if (i+1 < 4)
-                q += b2*qDelta(-1, i);
-            if (j+1 < 4)
-                q += b1*qDelta(-1, j);
-            q += b1*b2*qDelta(-1, -1);
-            Q[j][i] = (Q[i][j] += q);
+                c += b2*qDelta(-1, i);
+            if (n+1 < 4)
+                c += b1*qDelta(-1, n);
+            c += b1*b2*qDelta(-1, -1);
+            q[j] += c;
         }
-    }
 
-    // Then the lower right
-    for (i = M-1; i <= M; ++i) {
-        b1 = Beta(i);
-        for (int j = i - 3; j <= i; ++j) {
-            b2 = Beta(j);
-            q = 0.0;
+        // ...and in the lower right.
+        if (n >= M-1) {
+            b1 = Beta(n);
+            b2 = Beta(i);
+            c = 0.0;
+            if (M+1-n < 4)
+                c += b2*qDelta(n, M+1);
             if (M+1-i < 4)
-                q += b2*qDelta(i, M+1);
-            if (M+1-j < 4)
-                q += b1*qDelta(j, M+1);
-            q += b1*b2*qDelta(M+1, M+1);
-            Q[j][i] = (Q[i][j] += q);
+                c += b1*qDelta(i, M+1);
+            c += b1*b2*qDelta(M+1, M+1);
+            q[j] += c;
         }
     }
 }
 //////////////////////////////////////////////////////////////////////
-template<class T> void BSplineBase<T>::addP()
+/*
+ * Accumulate the upper bands of P into Pc.
+ */
+template<class T, class C> void BSplineBase<T, C>::addP()
+{
+    Matrix<C> &P = base->Pc;
+    P.setup(M+1, 0, 3);
+    P = 0;
+    C *a = P.storage();  // a[i*ld + j-i] is P(i,j)
+    const int ld = P.row_width();
+
+    // Keep the basis weights for solve() if requested, unless they are
+    // already cached and only the weights of the points have changed.
+    bool cache = basisCache && M >= 3 && base->Start.empty();
+    if (cache) {
+        base->Start.resize(NX);
+        base->Weights.resize(4*NX);
+    }
+
+    // Give each thread enough points to be worth its buffer.
+    static const int minPointsPerThread = 8192;
+    int ntasks = my::min(nThreads, NX / minPointsPerThread);
+    if (ntasks <= 1) {
+        addPoints(0, NX, a, ld, 0, cache);
+        return;
+    }
+
+    // Each task adds a contiguous range of points into its own buffer of
+    // the upper bands of the rows its points reach.
+    const XArray<T> X = base->xvalues();
+    std::vector<std::vector<C> > buffers(ntasks);
+    std::vector<int> first(ntasks);
+    std::mutex lock;
+    runTasks(ntasks, [&](int k) {
+        int i0 = (int)((long long)NX * k / ntasks);
+        int i1 = (int)((long long)NX * (k+1) / ntasks);
+        T lo = X[i0];
+        T hi = X[i0];
+        for (int i = i0+1; i < i1; ++i) {
+            lo = my::min(lo, X[i]);
+            hi = my::max(hi, X[i]);
+        }
+        // Take the rows from basisWeights() itself, since its start node
+        // never decreases with x, so that rounding cannot put a point's
+        // rows outside the buffer.
+        C w[4];
+        int r0 = basisWeights(lo, w);
+        int r1 = my::min(M, basisWeights(hi, w) + 3);
+        std::vector<C> &buffer = buffers[k];
+        buffer.assign((size_t)(r1 - r0 + 1) * 4, C());
+        first[k] = r0;
+        addPoints(i0, i1, &buffer[0], 4, r0, cache);
+        if (!deterministic) {
+            std::lock_guard<std::mutex> guard(lock);
+            for (int r = r0; r <= r1; ++r)
+                for (int j = 0; j < 4 && r+j <= M; ++j)
+                    a[(size_t)r*ld + j] += buffer[(size_t)(r-r0)*4 + j];
+            std::vector<C>().swap(buffer);
+        }
+    });
+    if (!deterministic)
+        return;
+
+    // Add the buffers into each block of rows in the order of the tasks,
+    // so the sums do not depend on which task finished first.
+    runTasks(ntasks, [&](int k) {
+        int b0 = (int)((long long)(M+1) * k / ntasks);
+        int b1 = (int)((long long)(M+1) * (k+1) / ntasks);
+        for (int t = 0; t < ntasks; ++t) {
+            const std::vector<C> &buffer = buffers[t];
+            int r0 = first[t];
+            int r1 = r0 + (int)(buffer.size() / 4) - 1;
+            for (int r = my::max(b0, r0); r < b1 && r <= r1; ++r)
+                for (int j = 0; j < 4 && r+j <= M; ++j)
+                    a[(size_t)r*ld + j] += buffer[(size_t)(r-r0)*4 + j];
+        }
+    });
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Add the products of the basis functions of points i0 to i1-1 into the
+ * upper bands @p a, where a[(i-r0)*ld + j-i] is element (i, j) of P, and
+ * fill in the basis weight cache for those points if @p cache is true.
+ */
+template<class T, class C> void BSplineBase<T, C>::addPoints(int i0,
+                                                             int i1,
+                                                             C *a,
+                                                             int ld,
+                                                             int r0,
+                                                             bool cache) const
 {
-    // Add directly to Q's elements
-    Matrix<T> &P = base->Q;
-    std::vector<T> &X = base->X;
+    const XArray<T> X = base->xvalues();
 
     // For each data point, sum the product of the nearest, non-zero Basis
-    // nodes
+    // nodes, times the weight of the point.
+    const T *W = base->W.empty() ? 0 : &base->W[0];
+    const int nw = my::min(4, M+1);
     int m, n, i;
-    for (i = 0; i < NX; ++i) {
-        // Which node does this put us in?
-        T &x = X[i];
-        int mx = (int)((x - xmin) / DX);
-
-        // Loop over the upper triangle of nonzero basis functions,
-        // and add in the products on each side of the diagonal.
-        for (m = my::max(0, mx-1); m <= my::min(M, mx+2); ++m) {
-            float pm = Basis(m, x);
-            float sum = pm * pm;
-            P[m][m] += sum;
-            for (n = m+1; n <= my::min(M, mx+2); ++n) {
-                float pn = Basis(n, x);
-                sum = pm * pn;
-                P[m][n] += sum;
-                P[n][m] += sum;
-            }
+    C b[4];
+    for (i = i0; i < i1; ++i) {
+        // The cached nodes always span four nodes within the domain,
+        // with zero weights at the ends.
+        int start = basisWeights(X[i], b);
+        if (cache) {
+            base->Start[i] = start;
+            std::copy(b, b+4, &base->Weights[4*i]);
+        }
+
+        C wi = W ? W[i] : 1;
+        if (wi == 0)
+            continue;
+
+        // Loop over the upper triangle of the basis weights, and add
+        // in the products on and above the diagonal.
+        for (m = 0; m < nw; ++m) {
+            C wm = wi * b[m];
+            C *row = a + (size_t)(start + m - r0) * ld;
+            for (n = m; n < nw; ++n)
+                row[n-m] += wm * b[n];
         }
     }
 }
 //////////////////////////////////////////////////////////////////////
-template<class T> bool BSplineBase<T>::factor()
+/*
+ * Run task(k) for k from 0 to ntasks-1 with the executor, else on new
+ * threads and this one.
+ */
+template<class T, class C>
+void BSplineBase<T, C>::runTasks(int ntasks,
+                                 const std::function<void (int)> &task) const
+{
+    if (executor) {
+        executor(ntasks, task);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (int k = 1; k < ntasks; ++k)
+        threads.push_back(std::thread(task, k));
+    task(0);
+    for (size_t k = 0; k < threads.size(); ++k)
+        threads[k].join();
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> int BSplineBase<T, C>::threads(int n)
+{
+    if (n == 0)
+        n = my::max(1, (int)std::thread::hardware_concurrency());
+    if (n > 0)
+        nThreads = n;
+    return nThreads;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> bool BSplineBase<T, C>::deterministicAssembly(int on)
+{
+    if (on >= 0)
+        deterministic = (on > 0);
+    return deterministic;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+void BSplineBase<T, C>::setExecutor(const Executor &e)
+{
+    executor = e;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Compute the basis weight cache for a domain which has already been
+ * set up, without touching the P+Q matrix.
+ */
+template<class T, class C> void BSplineBase<T, C>::addWeights()
 {
-    Matrix<T> &LU = base->Q;
+    if (M < 3)
+        return;
+    const XArray<T> X = base->xvalues();
+    base->Start.resize(NX);
+    base->Weights.resize(4*NX);
+    for (int i = 0; i < NX; ++i)
+        base->Start[i] = basisWeights(X[i], &base->Weights[4*i]);
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> bool BSplineBase<T, C>::factor()
+{
+    Matrix<C> &LU = base->Q;
 
-    if (LU_factor_banded(LU, 3) != 0) {
+    if (solverType == SOLVER_PARTITIONED) {
+        if (!factorPartitioned()) {
+            if (Debug())
+                std::cerr << "Partitioned factorization failed."
+                          << std::endl;
+            return false;
+        }
+        return true;
+    }
+    if (solverType == SOLVER_LDLT) {
+        if (LDLT_factor_banded_storage(LU, 3) != 0) {
+            if (Debug())
+                std::cerr << "LDLT_factor_banded_storage() failed."
+                          << std::endl;
+            return false;
+        }
+        if (Debug() && M < 30)
+            std::cerr << "LDL' decomposition: " << std::endl << LU
+                      << std::endl;
+        return true;
+    }
+
+    LU.symmetrize();
+    if (LU_factor_banded_storage(LU, 3) != 0) {
         if (Debug())
-            std::cerr << "LU_factor_banded() failed." << std::endl;
+            std::cerr << "LU_factor_banded_storage() failed." << std::endl;
         return false;
     }
     if (Debug() && M < 30)
@@ -529,9 +1368,347 @@ template<class T> bool BSplineBase<T>::factor()
     return true;
 }
 //////////////////////////////////////////////////////////////////////
-template<class T> inline double BSplineBase<T>::Ratiod(int &ni,
-                                                       double &deltax,
-                                                       double &ratiof)
+/*
+ * Solve (P+Q)a = b in place for @p nrhs right-hand sides interleaved by
+ * node, using the factorization from the current solver.
+ */
+template<class T, class C>
+bool BSplineBase<T, C>::solveBanded(C *b, int nrhs) const
+{
+    int err;
+    if (solverType == SOLVER_PARTITIONED) {
+        err = solvePartitioned(b, nrhs) ? 0 : 1;
+    } else if (solverType == SOLVER_LDLT) {
+        err = (nrhs == 1) ?
+            LDLT_solve_banded_storage(base->Q, b, 3) :
+            LDLT_solve_banded_many_storage(base->Q, b, nrhs, 3);
+    } else {
+        err = (nrhs == 1) ?
+            LU_solve_banded_storage(base->Q, b, 3) :
+            LU_solve_banded_many_storage(base->Q, b, nrhs, 3);
+    }
+    if (err && Debug())
+        std::cerr << "Banded solution failed." << std::endl;
+    return err == 0;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Store the elements of (P+Q)^-1 within its upper bands into @p z, four
+ * per node, by selected inversion of the factorization of P+Q.  Without
+ * pivoting, the LU factors of a symmetric matrix are U'D^-1 and U, with D
+ * the diagonal of U, so the U of LDL' is U divided by D row by row.  The
+ * blocks of SOLVER_PARTITIONED are not one factorization, so P+Q is
+ * factored again for them.
+ */
+template<class T, class C> bool BSplineBase<T, C>::inverseBands(C *z) const
+{
+    const int N = M+1;
+    int i, k;
+    if (solverType == SOLVER_PARTITIONED) {
+        const C *p = base->Pc.storage();
+        const C *q = base->Qc.storage();
+        const C ca = alpha;
+        for (i = 0; i < 4*N; ++i)
+            z[i] = p[i] + ca * q[i];
+        C v[3];
+        for (i = 0; i < N; ++i)
+            if (LDLT_factor_banded_row(z, 4, N, i, 3, v) != 0)
+                return false;
+    } else {
+        const Matrix<C> &F = base->Q;
+        const C *f = F.storage() - F.first_band();
+        const int ld = F.row_width();
+        for (i = 0; i < N; ++i) {
+            const C *fi = f + (size_t)i*ld;
+            z[4*i] = fi[0];
+            for (k = 1; k < 4; ++k) {
+                if (i+k >= N)
+                    z[4*i+k] = 0;
+                else if (solverType == SOLVER_LU)
+                    z[4*i+k] = fi[k] / fi[0];
+                else
+                    z[4*i+k] = fi[k];
+            }
+        }
+    }
+    return LDLT_inverse_banded_rows(z, 4, N, 3) == 0;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * The fewest nodes in each interior block of SOLVER_PARTITIONED, so the
+ * blocks are worth a thread and much larger than the separators.
+ */
+static const int minNodesPerPartition = 4096;
+//////////////////////////////////////////////////////////////////////
+/*
+ * Factor P+Q for SOLVER_PARTITIONED.  Separators of three rows split the
+ * nodes into interior blocks, whose rows couple only to the separators on
+ * either side of them.  Each interior block is factored as LDL' in place
+ * in Q, which leaves the separator rows and the coupling elements as they
+ * were.  The Schur complement of the interior blocks is a system for the
+ * separator nodes with five upper bands, which is assembled in S from the
+ * 3x3 coupling of each block and factored serially.
+ */
+template<class T, class C> bool BSplineBase<T, C>::factorPartitioned()
+{
+    Matrix<C> &A = base->Q;
+    C *a = A.storage();
+    const int ld = A.row_width();
+    const int N = M+1;
+    std::vector<int> &sep = base->Separators;
+
+    const int p = my::min(nThreads, N / minNodesPerPartition);
+    sep.clear();
+    base->S = Matrix<C>();
+    if (p <= 1)
+        return LDLT_factor_banded_storage(A, 3) == 0;
+    for (int j = 1; j < p; ++j)
+        sep.push_back((int)((long long)N * j / p));
+
+    // For each block, ll and rr are the 3x3 products E'A^-1E of its
+    // coupling E to the separators on its left and right, and lr is
+    // the product between the two.  With A = U'DU, E'A^-1F is W'D^-1V
+    // for W = U'^-1 E and V = U'^-1 F, and since the coupling to the
+    // right separator is in the last three rows of the block, so is V.
+    std::vector<C> ll(9*p, C()), lr(9*p, C()), rr(9*p, C());
+    std::vector<char> failed(p, 0);
+    runTasks(p, [&](int k) {
+        const int i0 = (k == 0) ? 0 : sep[k-1]+3;
+        const int n = ((k == p-1) ? N : sep[k]) - i0;
+        C *ak = a + (size_t)i0*ld;
+        C v[3];
+
+        // Factor the block one row at a time, and solve for the rows of
+        // W for the left separator as they are factored, keeping the
+        // last four.  wl[i%4][c] is row i of W for row c of the
+        // separator.  W decays away from the separator, so flush it to
+        // zero before it reaches the slow subnormal numbers.
+        C wl[4][3] = { { 0 } };
+        C *llk = &ll[9*k];
+        for (int i = 0; i < n; ++i) {
+            if (LDLT_factor_banded_row(ak, ld, n, i, 3, v) != 0) {
+                failed[k] = 1;
+                return;
+            }
+            if (k == 0)
+                continue;
+            C *w = wl[i%4];
+            for (int c = 0; c < 3; ++c) {
+                w[c] = (i <= c) ?
+                    a[(size_t)(sep[k-1]+c)*ld + 3+i-c] : C();
+                for (int j = my::max(0, i-3); j < i; ++j)
+                    w[c] -= ak[(size_t)j*ld + i-j] * wl[j%4][c];
+                if (my::abs(w[c]) < std::numeric_limits<C>::min())
+                    w[c] = 0;
+            }
+            for (int c1 = 0; c1 < 3; ++c1) {
+                const C wd = w[c1] / ak[(size_t)i*ld];
+                for (int c2 = 0; c2 < 3; ++c2)
+                    llk[3*c1+c2] += wd * w[c2];
+            }
+        }
+        if (k == p-1)
+            return;
+
+        // The rows of V for the right separator, vr[r][c] for row n-3+r
+        // of the block and row c of the separator.
+        C vr[3][3];
+        for (int r = 0; r < 3; ++r) {
+            const int i = n-3+r;
+            for (int c = 0; c < 3; ++c) {
+                vr[r][c] = (c <= r) ? ak[(size_t)i*ld + 3+c-r] : C();
+                for (int j = n-3; j < i; ++j)
+                    vr[r][c] -= ak[(size_t)j*ld + i-j] * vr[j-(n-3)][c];
+            }
+        }
+        for (int r = 0; r < 3; ++r) {
+            const int i = n-3+r;
+            const C d = ak[(size_t)i*ld];
+            for (int c1 = 0; c1 < 3; ++c1) {
+                for (int c2 = 0; c2 < 3; ++c2) {
+                    lr[9*k + 3*c1+c2] += wl[i%4][c1] * vr[r][c2] / d;
+                    rr[9*k + 3*c1+c2] += vr[r][c1] * vr[r][c2] / d;
+                }
+            }
+        }
+    });
+    for (int k = 0; k < p; ++k)
+        if (failed[k])
+            return false;
+
+    // Separator j lies between blocks j and j+1.  A single separator
+    // has no bands past its own 3x3 block.
+    Matrix<C> &S = base->S;
+    S.setup(3*(p-1), 0, (p == 2) ? 2 : 5);
+    S = 0;
+    for (int j = 0; j < p-1; ++j) {
+        for (int c1 = 0; c1 < 3; ++c1) {
+            for (int c2 = c1; c2 < 3; ++c2)
+                S[3*j+c1][3*j+c2] = a[(size_t)(sep[j]+c1)*ld + c2-c1] -
+                    rr[9*j + 3*c1+c2] - ll[9*(j+1) + 3*c1+c2];
+            for (int c2 = 0; c2 < 3 && j < p-2; ++c2)
+                S[3*j+c1][3*j+3+c2] = -lr[9*(j+1) + 3*c1+c2];
+        }
+    }
+    return LDLT_factor_banded_storage(S, S.last_band()) == 0;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Solve (P+Q)a = b in place with the factorization from
+ * factorPartitioned().  Each interior block is solved once in parallel
+ * to reduce the separator rows, the separator system is solved, and each
+ * block is solved again with the separator nodes known.
+ */
+template<class T, class C>
+bool BSplineBase<T, C>::solvePartitioned(C *b, int nrhs) const
+{
+    const Matrix<C> &A = base->Q;
+    const std::vector<int> &sep = base->Separators;
+    if (sep.empty())
+        return ((nrhs == 1) ?
+                LDLT_solve_banded_storage(A, b, 3) :
+                LDLT_solve_banded_many_storage(A, b, nrhs, 3)) == 0;
+
+    const C *a = A.storage();
+    const int ld = A.row_width();
+    const int N = M+1;
+    const int p = (int)sep.size() + 1;
+    const size_t w = nrhs;
+    auto solveBlock = [&](const C *ak, int n, C *bk) {
+        return (nrhs == 1) ?
+            LDLT_solve_banded_rows(ak, ld, n, bk, 3) :
+            LDLT_solve_banded_many_rows(ak, ld, n, bk, nrhs, 3);
+    };
+
+    // The separator rows of b, less the contributions of the blocks on
+    // their left and right.
+    std::vector<C> xs((size_t)3*(p-1)*w);
+    for (int j = 0; j < p-1; ++j)
+        std::copy(b + (size_t)sep[j]*w, b + (size_t)(sep[j]+3)*w,
+                  &xs[(size_t)3*j*w]);
+    std::vector<C> left((size_t)3*p*w, C()), right((size_t)3*p*w, C());
+    std::vector<char> failed(p, 0);
+    runTasks(p, [&](int k) {
+        const int i0 = (k == 0) ? 0 : sep[k-1]+3;
+        const int n = ((k == p-1) ? N : sep[k]) - i0;
+        const C *ak = a + (size_t)i0*ld;
+        std::vector<C> g(b + (size_t)i0*w, b + (size_t)(i0+n)*w);
+        if (solveBlock(ak, n, &g[0]) != 0) {
+            failed[k] = 1;
+            return;
+        }
+        for (int c = 0; c < 3; ++c) {
+            for (int r = 0; r < 3; ++r) {
+                if (k > 0 && r <= c) {
+                    C e = a[(size_t)(sep[k-1]+c)*ld + 3+r-c];
+                    for (size_t q = 0; q < w; ++q)
+                        left[(3*k+c)*w + q] += e * g[r*w + q];
+                }
+                if (k < p-1 && c <= r) {
+                    C e = ak[(size_t)(n-3+r)*ld + 3+c-r];
+                    for (size_t q = 0; q < w; ++q)
+                        right[(3*k+c)*w + q] += e * g[(n-3+r)*w + q];
+                }
+            }
+        }
+    });
+    for (int k = 0; k < p; ++k)
+        if (failed[k])
+            return false;
+
+    for (int j = 0; j < p-1; ++j)
+        for (size_t i = 0; i < 3*w; ++i)
+            xs[3*j*w + i] -= right[3*j*w + i] + left[3*(j+1)*w + i];
+    if (LDLT_solve_banded_many_storage(base->S, &xs[0], nrhs,
+                                       base->S.last_band()) != 0)
+        return false;
+
+    runTasks(p, [&](int k) {
+        const int i0 = (k == 0) ? 0 : sep[k-1]+3;
+        const int n = ((k == p-1) ? N : sep[k]) - i0;
+        const C *ak = a + (size_t)i0*ld;
+        C *bk = b + (size_t)i0*w;
+        for (int c = 0; c < 3; ++c) {
+            for (int r = 0; r < 3; ++r) {
+                if (k > 0 && r <= c) {
+                    C e = a[(size_t)(sep[k-1]+c)*ld + 3+r-c];
+                    for (size_t q = 0; q < w; ++q)
+                        bk[r*w + q] -= e * xs[(3*(k-1)+c)*w + q];
+                }
+                if (k < p-1 && c <= r) {
+                    C e = ak[(size_t)(n-3+r)*ld + 3+c-r];
+                    for (size_t q = 0; q < w; ++q)
+                        bk[(n-3+r)*w + q] -= e * xs[(3*k+c)*w + q];
+                }
+            }
+        }
+        if (solveBlock(ak, n, bk) != 0)
+            failed[k] = 1;
+    });
+    for (int j = 0; j < p-1; ++j)
+        std::copy(&xs[(size_t)3*j*w], &xs[(size_t)3*(j+1)*w],
+                  b + (size_t)sep[j]*w);
+    for (int k = 0; k < p; ++k)
+        if (failed[k])
+            return false;
+    return true;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> bool BSplineBase<T, C>::reweight(const T *weights)
+{
+    if (!base->laidOut)
+        return false;
+    detach();
+    if (weights)
+        base->W.assign(weights, weights+NX);
+    else
+        base->W.clear();
+
+    // The nodes and Q are unchanged, so only P is accumulated again.
+    addP();
+    assemble();
+    OK = factor();
+    return OK;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> bool BSplineBase<T, C>::setWavelength(double wl)
+{
+    if (!base->laidOut || wl < 0)
+        return false;
+    detach();
+    waveLength = wl;
+    alpha = Alpha(wl);
+    if (Debug())
+        std::cerr << "Cutoff wavelength: " << waveLength << " ; "
+                  << "Alpha: " << alpha << std::endl;
+    assemble();
+    OK = factor();
+    return OK;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> bool BSplineBase<T, C>::setSolver(int type)
+{
+    if (type != SOLVER_LU && type != SOLVER_LDLT &&
+        type != SOLVER_PARTITIONED)
+        return false;
+    if (type == solverType)
+        return OK;
+    solverType = type;
+
+    // Assemble and factor P+Q again for the new solver from the P and Q
+    // which are kept.
+    if (OK) {
+        detach();
+        assemble();
+        OK = factor();
+    }
+    return OK;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+inline double BSplineBase<T, C>::Ratiod(int &ni,
+                                        double &deltax,
+                                        double &ratiof)
 {
     deltax = (xmax - xmin) / ni;
     ratiof = waveLength / deltax;
@@ -554,20 +1731,18 @@ template<class T> inline double BSplineBase<T>::Ratiod(int &ni,
 // The algorithm in this routine is mostly taken from the FORTRAN
 // implementation by James Franklin, NOAA/HRD.
 //
-template<class T> bool BSplineBase<T>::Setup(int num_nodes)
+template<class T, class C> bool BSplineBase<T, C>::Setup(int num_nodes)
 {
-    std::vector<T> &X = base->X;
-
-    // Find the min and max of the x domain
-    xmin = X[0];
-    xmax = X[0];
-
-    int i;
-    for (i = 1; i < NX; ++i) {
-        if (X[i] < xmin)
-            xmin = X[i];
-        else if (X[i] > xmax)
-            xmax = X[i];
+    // Find the min and max of the x domain in one pass.
+    const XArray<T> X = base->xvalues();
+    if (X.contiguous()) {
+        bspline_minmax(X.contiguous(), NX, xmin, xmax);
+    } else {
+        xmin = xmax = X[0];
+        for (int i = 1; i < NX; ++i) {
+            xmin = my::min(xmin, X[i]);
+            xmax = my::max(xmax, X[i]);
+        }
     }
     if (Debug())
 	std::cerr << "Xmax=" << xmax << ", Xmin=" << xmin << std::endl;
@@ -621,40 +1796,68 @@ template<class T> bool BSplineBase<T>::Setup(int num_nodes)
 	// number of intervals for which the intervals per wavelength is
 	// still adequate.  I think the minimum must be more than 2 since
 	// the basis function is evaluated on multiple nodes.
-	ni = 5;
+	//
+	// The intervals per wavelength never decrease and the points per
+	// interval never increase as intervals are added, even with
+	// rounding, so each of the searches below is a bisection for the
+	// first number of intervals which passes a test.  That gives the
+	// same number as adding one interval at a time from 6.
+        int lo, hi, mid;
 
         double ratiof; // Nodes per wavelength for current deltax
         double ratiod; // Points per node interval
 
         // Increase the number of node intervals until we reach the minimum
         // number of intervals per cutoff wavelength, but only as long as 
-        // we can maintain at least one point per interval.
-        do {
-            if (Ratiod(++ni, deltax, ratiof) < 1.0)
+        // we can maintain at least one point per interval.  There is less
+        // than one point per interval from NX intervals on.
+        lo = 6;
+        hi = my::max(lo, NX);
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            Ratiod(mid, deltax, ratiof);
+            if (ratiof < fmin)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        ni = lo;
+        if (Ratiod(ni, deltax, ratiof) < 1.0)
+	{
+	    if (Debug())
 	    {
-		if (Debug())
-		{
-		    std::cerr << "At " << ni << " intervals, fewer than "
-			      << "one point per interval, and "
-			      << "intervals per wavelength is "
-			      << ratiof << "." << std::endl;
-		}
-                return false;
+		std::cerr << "At " << ni << " intervals, fewer than "
+			  << "one point per interval, and "
+			  << "intervals per wavelength is "
+			  << ratiof << "." << std::endl;
 	    }
-        } while (ratiof < fmin);
+            return false;
+	}
 
         // Now increase the number of intervals until we have at least 4
         // intervals per cutoff wavelength, but only as long as we can
         // maintain at least 2 points per node interval.  There's also no
         // point to increasing the number of intervals if we already have
-        // 15 or more nodes per cutoff wavelength.
+        // 15 or more nodes per cutoff wavelength.  So stop at the first
+        // number of intervals which either meets the goal or goes too
+        // far, in which case back up by one.
         // 
-        do {
-            if ((ratiod = Ratiod(++ni, deltax, ratiof)) < 1.0 || ratiof > 15.0) {
-                --ni;
-                break;
-            }
-        } while (ratiof < 4 || ratiod > 2.0);
+        lo = ni + 1;
+        hi = my::max(lo, NX);
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            ratiod = Ratiod(mid, deltax, ratiof);
+            if (ratiod < 1.0 || ratiof > 15.0 ||
+                (ratiof >= 4 && ratiod <= 2.0))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        ni = lo;
+        ratiod = Ratiod(ni, deltax, ratiof);
+        if (ratiod < 1.0 || ratiof > 15.0) {
+            ratiod = Ratiod(--ni, deltax, ratiof);
+        }
 
 	if (Debug())
 	{
@@ -673,7 +1876,7 @@ template<class T> bool BSplineBase<T>::Setup(int num_nodes)
     return (true);
 }
 //////////////////////////////////////////////////////////////////////
-template<class T> const T * BSplineBase<T>::nodes(int *nn)
+template<class T, class C> const T * BSplineBase<T, C>::nodes(int *nn) const
 {
     if (base->Nodes.size() == 0) {
         base->Nodes.reserve(M+1);
@@ -16,18 +16,23 @@
 #define BSPLINEBASE_H_
 
 #include <BSpline/BSpline_visibility.h>
+
+#include <memory>
+#include <functional>
 /**
  * @file
  *
  * This file defines the BSpline library interface.
  *
  */
-template <class T> class BSpline;
+template <class T, class C = T> class BSpline;
+template <class T, class C> struct BSplineDomainCacheP;
+template <class T, class C> class BSplineEvaluationPlan;
 
 /*
  * Opaque member structure to hide the matrix implementation.
  */
-template <class T> struct BSplineBaseP;
+template <class T, class C> struct BSplineBaseP;
 
 /**
  * @class BSplineBase
@@ -110,6 +115,18 @@ template <class T> struct BSplineBaseP;
  * the solution (or non-solution) of the spline.  Remember to check the
  * ok() method to detect when the spline solution has failed.
  *
+ * The x values, nodes, and factored P+Q matrix of a domain are shared,
+ * not copied, when a BSplineBase is copied or a BSpline is created from
+ * it, so each curve applied to a domain only holds its own coefficients
+ * and mean.  The shared state is never changed while it is shared:
+ * calling setDomain(), borrowDomain(), reweight(), setSolver(),
+ * setWavelength(), or cacheBasis() on one of the copies first gives that
+ * copy its own domain state.  The x values given to borrowDomain() are
+ * shared the same way, and are read again by reweight(), cacheBasis(),
+ * solveMany(), selectWavelength(), and the BSpline constructor with y
+ * values, solve(), fittedValues(), residualStats(), variance(), and
+ * residualVariance().
+ *
  * The interface for the BSplineBase and BSpline templates is defined in 
  * the header file BSpline.h.  The implementation is defined in BSpline.cpp.
  * Source files which will instantiate the template should include the
@@ -122,6 +139,13 @@ template <class T> struct BSplineBaseP;
  * For debugging, an application can include the implementation to get its
  * own instantiation.
  *
+ * The optional second template parameter is the compute type, in which
+ * the P+Q matrix is assembled, factored, and solved.  It defaults to the
+ * datum type, but BSpline<float, double> keeps the x values, y values,
+ * and evaluations in float while solving for the coefficients in double,
+ * which avoids most of the rounding error of BSpline<float> for little
+ * extra cost.  The library also contains BSpline<float, double>.
+ *
  * The algorithm is based on the cubic spline described by Katsuyuki Ooyama
  * in Montly Weather Review, Vol 115, October 1987.  This implementation
  * has benefited from comparisons with a previous FORTRAN implementation by
@@ -162,13 +186,25 @@ All rights reserved.
 @endverbatim
  **/
 
-template <class T> 
+template <class T, class C = T>
 class BSplineBase  
 {
 public:
     // Datum type
     typedef T datum_type;
 
+    // Compute type, for assembling and solving the P+Q matrix
+    typedef C compute_type;
+
+    /**
+     * An executor runs @p task(k) for each k from 0 to @p ntasks-1, on
+     * any threads and in any order, and returns once they have all
+     * finished.
+     */
+    typedef std::function<void (int ntasks,
+                                const std::function<void (int)> &task)>
+    Executor;
+
     /// Return a string describing the bspline library version.
     static const char *Version();
     
@@ -192,6 +228,30 @@ public:
     BC_ZERO_SECOND = 2
     };
 
+    /**
+     * Factorizations for solving the banded P+Q system.
+     */
+    enum SolverTypes
+    {
+    /// LU factor all seven bands of P+Q.  This is the default.
+    SOLVER_LU = 0,
+    /// Factor P+Q as LDL', storing only the diagonal and 3 upper bands.
+    SOLVER_LDLT = 1,
+    /// Factor and solve blocks of LDL' in parallel.  See setSolver().
+    SOLVER_PARTITIONED = 2
+    };
+
+    /**
+     * Scores for choosing a cutoff wavelength with selectWavelength().
+     */
+    enum SelectionCriteria
+    {
+    /// Generalized cross-validation.  This is the default.
+    SELECT_GCV = 0,
+    /// Leave-one-out cross-validation.
+    SELECT_LOO = 1
+    };
+
 public:
 
     /**
@@ -204,8 +264,29 @@ public:
          double wl, int bc_type = BC_ZERO_SECOND,
          int num_nodes = 0);
 
-    /// Copy constructor
-    BSplineBase (const BSplineBase &);
+    /**
+     * Construct an empty domain, which is not ok() until setDomain() or
+     * borrowDomain() succeeds.
+     */
+    BSplineBase ();
+
+    /**
+     * Copy constructor.  The copy shares the domain state of @p b
+     * rather than copying it.
+     */
+    BSplineBase (const BSplineBase &b);
+
+    /**
+     * Move constructor.  The domain state of @p b is taken over, leaving
+     * @p b empty and not ok().
+     */
+    BSplineBase (BSplineBase &&b);
+
+    /// Share the domain state of @p b, as for the copy constructor.
+    BSplineBase &operator= (const BSplineBase &b);
+
+    /// Take over the domain state of @p b, as for the move constructor.
+    BSplineBase &operator= (BSplineBase &&b);
 
     /**
      * Change the domain of this base.  [If this is part of a BSpline
@@ -229,12 +310,69 @@ public:
      *          If less than 2 a reasonable number will be
      *          calculated automatically, if possible, taking
      *          into account the given cutoff wavelength.
+     * @param weights   If not null, the non-negative weight of each x
+     *          value in the least squares fit, as in SPLCW.  Every
+     *          spline solved over this domain is fit to the weighted
+     *          y values, less their weighted mean.  See reweight().
      *
      * @see ok().
      */
     bool setDomain (const T *x, int nx, double wl, 
             int bc_type = BC_ZERO_SECOND,
-            int num_nodes = 0);
+            int num_nodes = 0, const T *weights = 0);
+
+    /**
+     * Set up the domain as for setDomain(), but refer to the caller's x
+     * values instead of copying them, such as a memory-mapped column or
+     * a field of an array of records.  The x values must not change or
+     * be freed while this domain, or any BSplineBase or BSpline which
+     * shares it, is still in use, since they are read again by
+     * reweight(), cacheBasis(), solveMany(), selectWavelength(), and by
+     * the BSpline constructor with y values, BSpline::solve(),
+     * fittedValues(), residualStats(), variance(), and
+     * residualVariance().  setSolver() and setWavelength() do not read
+     * them.  The weights, if any, are still copied.
+     *
+     * @param stride    The distance in bytes from one x value to the
+     *          next, at least sizeof(T) and a multiple of the
+     *          alignment of T.  The default is a packed array.
+     *
+     * Returns false if the stride is invalid or the setup fails.
+     */
+    bool borrowDomain (const T *x, int nx, double wl,
+            int bc_type = BC_ZERO_SECOND,
+            int num_nodes = 0, const T *weights = 0,
+            size_t stride = sizeof(T));
+
+    /**
+     * Change the weight of each x value in the domain, such as to
+     * discount outliers between iterations of a quality control loop,
+     * and factor P+Q again.  The nodes, alpha, and Q from setDomain() are
+     * kept, so only P is accumulated again.  Pass a null @p weights to go
+     * back to equal weights.  Splines already solved are not changed;
+     * call BSpline::solve() to fit them again with the new weights.
+     * Returns false if the domain was never set up successfully or if
+     * P+Q cannot be factored with these weights, such as when the
+     * weights are zero over too many node intervals.
+     */
+    bool reweight (const T *weights);
+
+    /**
+     * Change the cutoff wavelength of the domain and factor P+Q again,
+     * keeping its nodes and its x values.  P and Q are kept apart when
+     * the domain is set up, so only P + alpha*Q is formed again for the
+     * new alpha, at O(M) cost, without another pass over the x values.
+     * The nodes are not fitted to the new wavelength as setDomain() would
+     * fit them, so this suits domains with an explicit number of nodes,
+     * or wavelengths no shorter than two node intervals.  A wavelength
+     * of zero disables the derivative constraint.  Splines already
+     * solved are not changed.  Returns false if the domain was never set
+     * up successfully or if P+Q cannot be factored.
+     *
+     * A sweep over wavelengths can be scored first with
+     * selectWavelength().
+     */
+    bool setWavelength (double wl);
 
     /**
      * Create a BSpline smoothed curve for the given set of NX y values.
@@ -243,41 +381,92 @@ public:
      *      x values in the domain.
      * @see ok()
      */
-    BSpline<T> *apply (const T *y);
+    BSpline<T, C> *apply (const T *y) const;
+
+    /**
+     * Solve for the coefficients of several curves over this domain at
+     * once, such as multiple channels sampled on the same x values.  The
+     * B vectors for all of the channels are built in a single pass over
+     * the domain, and each substitution through the factored P+Q matrix
+     * is applied to every channel together.  Returns false if the domain
+     * is not ok() or the solution fails.
+     *
+     * @param y     The y values, where channel @p c occupies
+     *          y[c*stride] through y[c*stride + nX() - 1].
+     * @param nchannels The number of channels in @p y.
+     * @param stride    The distance between the start of consecutive
+     *          channels in @p y, at least nX().
+     * @param coeffs    Receives the nNodes() coefficients of each
+     *          channel, channel @p c starting at coeffs[c*nNodes()],
+     *          in the same order as BSpline::coefficient().
+     * @param means     If not null, receives the mean of each channel,
+     *          which is removed before solving and must be added
+     *          back to evaluate the curve.
+     */
+    bool solveMany (const T *y, int nchannels, int stride, T *coeffs,
+            T *means = 0) const;
+
+    /**
+     * Choose the cutoff wavelength for smoothing the given y values from
+     * @p n candidate @p wavelengths, keeping the nodes of this domain.
+     * Each candidate is scored by one of the SelectionCriteria, and the
+     * one with the lowest score is stored in @p best.  If @p scores is
+     * not null, it receives the score of every candidate, or infinity
+     * for a candidate whose P+Q cannot be factored.  The domain itself
+     * is not changed: pass the best wavelength to setWavelength() to use
+     * it.  Returns false if the domain is not ok() or none of the
+     * candidates can be scored.
+     *
+     * The scores need the trace of the hat matrix, which maps the y
+     * values to the fitted values at each x.  It is the trace of the
+     * product of (P+Q)^-1 and P, and since P is banded only the elements
+     * of (P+Q)^-1 within its bands are needed.  Those are found from the
+     * banded LDL' factors of P+Q by selected inversion, so each SELECT_GCV
+     * candidate costs O(M) once P has been accumulated.  SELECT_LOO also
+     * computes the residual and the leverage of every x, so it costs
+     * O(nX()) per candidate.
+     *
+     * The nodes must be dense enough for the shortest candidate, so set
+     * up the domain with the shortest wavelength, or with an explicit
+     * number of nodes.  The y values are weighted as in solve().
+     */
+    bool selectWavelength (const T *y, const double *wavelengths, int n,
+                           double *best, double *scores = 0,
+                           int criterion = SELECT_GCV) const;
 
     /**
      * Return array of the node coordinates.  Returns 0 if not ok().  The
      * array of nodes returned by nodes() belongs to the object and should
      * not be deleted; it will also be invalid if the object is destroyed.
      */
-    const T *nodes (int *nnodes);
+    const T *nodes (int *nnodes) const;
 
     /** 
      * Return the number of nodes (one more than the number of intervals).
      */
-    int nNodes () { return M+1; }
+    int nNodes () const { return M+1; }
 
     /**
      * Number of original x values.
      */
-    int nX () { return NX; }
+    int nX () const { return NX; }
 
     /// Minimum x value found.
-    T Xmin () { return xmin; }
+    T Xmin () const { return xmin; }
 
     /// Maximum x value found.
-    T Xmax () { return xmin + (M * DX); }
+    T Xmax () const { return xmin + (M * DX); }
 
     /** 
      * Return the Alpha value for a given wavelength.  Note that this
      * depends on the current node interval length (DX).
      */
-    double Alpha (double wavelength);
+    double Alpha (double wavelength) const;
 
     /**
      * Return alpha currently in use by this domain.
      */
-    double Alpha () { return alpha; }
+    double Alpha () const { return alpha; }
 
     /**
      * Return the current state of the object, either ok or not ok.
@@ -287,13 +476,102 @@ public:
      * found for a given wavelength, or when the linear equation for the
      * coefficients cannot be solved.
      */
-    bool ok () { return OK; }
+    bool ok () const { return OK; }
+
+    /**
+     * Call this method with a value greater than zero to keep the basis
+     * function weights at each x value in the domain, or with zero to
+     * release them.  Calling with no arguments returns true if the
+     * weights are cached, else false.
+     *
+     * The cache holds the first node index and the four basis weights
+     * for every x, computed once when the domain is set up.  Solving for
+     * each new set of y values then only gathers the cached weights
+     * instead of evaluating the basis functions again, at the cost of
+     * storing four weights and an index per x value.  The weights are
+     * not cached for domains with fewer than four nodes.
+     */
+    bool cacheBasis (int on = -1);
+
+    /**
+     * Select how the P+Q matrix is factored and solved, one of the
+     * SolverTypes.  P+Q is symmetric and positive definite, so
+     * SOLVER_LDLT stores only the diagonal and upper bands and factors
+     * them as LDL', roughly halving the memory and the operations of the
+     * factorization and of each solution compared to SOLVER_LU.  The two
+     * solvers agree to within rounding.  If the domain is already set
+     * up, P+Q is assembled and factored again with the new solver.
+     * Returns false if @p type is not a solver type or if the domain is
+     * not ok().
+     *
+     * SOLVER_PARTITIONED splits the nodes into one block per thread, of
+     * at least 4096 nodes each, separated by three nodes.  The
+     * blocks are factored as LDL' in parallel, and so is the 3x3
+     * coupling of each block to its neighboring separators, which
+     * together form a small banded system for the separator nodes.  A
+     * solution then substitutes through every block in parallel, solves
+     * the separator system serially, and substitutes through every block
+     * again.  That is about twice the work of SOLVER_LDLT, so it pays
+     * off for large domains with several threads.  With too few nodes
+     * for two blocks it is the same as SOLVER_LDLT.  See threads().
+     */
+    bool setSolver (int type);
+
+    /// Return the current solver type.
+    int solver () const { return solverType; }
+
+    /**
+     * Call this method with @p n greater than zero to assemble P, and to
+     * factor and solve P+Q with SOLVER_PARTITIONED, with up to @p n
+     * threads, or with zero for the number of hardware threads.  Calling
+     * with no arguments returns the number of threads.  The default is
+     * 1, which assembles P serially.
+     *
+     * With more than one thread, the x values are split into one
+     * contiguous range per thread, of at least a few thousand points
+     * each.  Each thread adds the products of the basis functions for its
+     * range into its own band buffer, which only spans the rows its range
+     * reaches, and the buffers are then added into P.  The buffers are
+     * smallest when the x values are sorted.  P is only assembled by
+     * setDomain(), borrowDomain(), and reweight(), so the setting takes
+     * effect for P the next time one of those is called.  setSolver() and
+     * setWavelength() only form P+Q again from the P already assembled,
+     * but the setting applies to their factoring with SOLVER_PARTITIONED.
+     */
+    int threads (int n = -1);
+
+    /**
+     * Call this method with a value greater than zero to add the thread
+     * buffers into P+Q in a fixed order, or with zero to add each buffer
+     * as soon as its thread finishes.  Calling with no arguments returns
+     * true if the order is fixed, else false.  In the fixed order, P+Q is
+     * bitwise reproducible from run to run for the same number of
+     * threads, whatever the scheduling, and the buffers are added by all
+     * of the threads together, a block of rows each.  Otherwise P+Q can
+     * differ in rounding between runs.  Either way the rounding differs
+     * from serial assembly.
+     */
+    bool deterministicAssembly (int on = -1);
+
+    /**
+     * Run the threads of parallel assembly and of SOLVER_PARTITIONED
+     * with @p executor, such as a thread pool of the caller's, instead
+     * of starting new threads each time.  Pass an empty executor to go
+     * back to new threads.
+     */
+    void setExecutor (const Executor &executor);
 
     virtual ~BSplineBase();
 
 protected:
 
-    typedef BSplineBaseP<T> Base;
+    // The cache compares x values with, and sizes, the domains it holds.
+    friend struct BSplineDomainCacheP<T, C>;
+
+    // A plan computes the basis weights of its output x values.
+    friend class BSplineEvaluationPlan<T, C>;
+
+    typedef BSplineBaseP<T, C> Base;
 
     // Provided
     double waveLength;  // Cutoff wavelength (l sub c)
@@ -308,17 +586,48 @@ protected:
     double DX;          // Interval length in same units as X
     double alpha;
     bool OK;
-    Base *base;         // Hide more complicated state members
+    bool basisCache;    // Keep the basis weights at each X
+    int solverType;     // One of SolverTypes
+    int nThreads;       // Threads for assembling P and partitioned solving
+    bool deterministic; // Add the thread buffers in a fixed order
+    Executor executor;  // Runs the assembly threads, if not empty
+    std::shared_ptr<Base> base; // Hide more complicated state members
                     // from the public interface.
 
+    bool layOut (const T *x, int nx, size_t stride, bool borrow,
+                 double wl, int bc, int num_nodes, const T *weights);
+    void copyState (const BSplineBase &b);
+    void clearState ();
+    void detach ();
+
     bool Setup (int num_nodes = 0);
     void calculateQ ();
-    double qDelta (int m1, int m2);
-    double Beta (int m);
+    void assemble ();
+    void qRow (int i, C *q) const;
+    double qDelta (int m1, int m2) const;
+    double Beta (int m) const;
     void addP ();
+    void addPoints (int i0, int i1, C *a, int ld, int r0,
+                    bool cache) const;
+    void runTasks (int ntasks, const std::function<void (int)> &task) const;
+    bool factorPartitioned ();
+    bool solvePartitioned (C *b, int nrhs) const;
+    void addWeights ();
     bool factor ();
-    double Basis (int m, T x);
-    double DBasis (int m, T x);
+    bool solveBanded (C *b, int nrhs) const;
+    bool inverseBands (C *z) const;
+    template <class D>
+    double basisSums (const T *y, C mean, D *c, D *s, int inc,
+                      double *rwr, int *npoints) const;
+    template <class D>
+    double hatTrace (const D *z, const D *s, const D *v, int inc,
+                     double wsum) const;
+    C dataMean (const T *y) const;
+    double Basis (int m, T x) const;
+    double DBasis (int m, T x) const;
+    double D2Basis (int m, T x) const;
+    int basisWeights (T x, C *w) const;
+    int basisWeightsAt (T x, C *w, int order = 0) const;
 
     static const double BoundaryConditions[3][4];
     static const double PI;
@@ -0,0 +1,292 @@
+// -*- mode: c++; c-basic-offset: 4; -*-
+/************************************************************************
+ * Copyright 2009 University Corporation for Atmospheric Research.
+ * All rights reserved.
+ *
+ * Use of this code is subject to the standard BSD license:
+ *
+ *  http://www.opensource.org/licenses/bsd-license.html
+ *
+ * See the COPYRIGHT file in the source distribution for the license text,
+ * or see this web page:
+ *
+ *  http://www.eol.ucar.edu/homes/granger/bspline/doc/
+ *
+ *************************************************************************/
+
+/**
+ * @file
+ *
+ * This file defines the implementation for the BSplineDomainCache
+ * template.
+ **/
+#include "BSplineDomainCache.h"
+
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include <cstring>
+#include <stdint.h>
+
+
+//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+// BSplineDomainCache Class
+//////////////////////////////////////////////////////////////////////
+
+template<class T, class C> struct BSplineDomainCacheP
+{
+        typedef BSplineBase<T, C> BaseT;
+
+        // The parameters of a cached domain, besides its x values, which
+        // the domain itself holds.
+        struct Entry
+        {
+            uint64_t hash;
+            int nx;
+            double wl;
+            int bc;
+            int num_nodes;
+            size_t bytes;
+            std::shared_ptr<const BaseT> domain;
+        };
+        typedef std::list<Entry> List;
+        typedef std::unordered_multimap<uint64_t,
+                                        typename List::iterator> Index;
+
+        // The entries from the most to the least recently used.
+        List lru;
+        Index index;
+
+        size_t budget;
+        size_t used;
+        unsigned long hits;
+        unsigned long misses;
+        unsigned long evictions;
+        mutable std::mutex lock;
+
+        /*
+         * Hash the bytes of the x values with the other parameters, eight
+         * bytes at a time with the FNV-1a multiplier.
+         */
+        static uint64_t hash(const T *x, int nx, double wl, int bc,
+                             int num_nodes)
+        {
+            uint64_t h = 14695981039346656037ULL;
+            const uint64_t prime = 1099511628211ULL;
+            uint64_t word;
+            std::memcpy(&word, &wl, sizeof(word));
+            h = (h ^ word) * prime;
+            h = (h ^ (uint64_t)bc) * prime;
+            h = (h ^ (uint64_t)num_nodes) * prime;
+            h = (h ^ (uint64_t)nx) * prime;
+
+            const unsigned char *p = (const unsigned char *)x;
+            size_t n = (size_t)nx * sizeof(T);
+            for (; n >= sizeof(word); n -= sizeof(word), p += sizeof(word)) {
+                std::memcpy(&word, p, sizeof(word));
+                h = (h ^ word) * prime;
+            }
+            for (; n > 0; --n, ++p)
+                h = (h ^ *p) * prime;
+            return h;
+        }
+
+        /*
+         * Return the cached entry for these parameters and make it the most
+         * recently used, else return null.
+         */
+        std::shared_ptr<const BaseT> find(uint64_t h, const T *x, int nx,
+                                          double wl, int bc, int num_nodes)
+        {
+            std::pair<typename Index::iterator,
+                      typename Index::iterator> r = index.equal_range(h);
+            for (typename Index::iterator it = r.first; it != r.second;
+                 ++it) {
+                Entry &e = *it->second;
+                if (e.nx == nx && e.wl == wl && e.bc == bc &&
+                    e.num_nodes == num_nodes &&
+                    e.domain->base->X.size() == (size_t)nx &&
+                    std::memcmp(&e.domain->base->X[0], x,
+                                (size_t)nx * sizeof(T)) == 0) {
+                    lru.splice(lru.begin(), lru, it->second);
+                    return e.domain;
+                }
+            }
+            return std::shared_ptr<const BaseT>();
+        }
+
+        /*
+         * Remove the least recently used entries until the cache is within
+         * @p limit bytes.
+         */
+        void evict(size_t limit)
+        {
+            while (used > limit && !lru.empty()) {
+                Entry &e = lru.back();
+                std::pair<typename Index::iterator,
+                          typename Index::iterator> r =
+                    index.equal_range(e.hash);
+                for (typename Index::iterator it = r.first; it != r.second;
+                     ++it) {
+                    if (&*it->second == &e) {
+                        index.erase(it);
+                        break;
+                    }
+                }
+                used -= e.bytes;
+                lru.pop_back();
+                ++evictions;
+            }
+        }
+
+        /*
+         * Approximate the memory held by a domain: the copy of the x
+         * values, the nodes, and the bands of P+Q, of Q, and of P.
+         */
+        static size_t bytes(const BaseT &b)
+        {
+            return sizeof(BaseT) + sizeof(*b.base) +
+                b.base->X.capacity() * sizeof(T) +
+                b.base->Nodes.capacity() * sizeof(T) +
+                ((size_t)b.base->Q.num_rows() * b.base->Q.row_width() +
+                 2 * (size_t)b.base->Qc.num_rows() * b.base->Qc.row_width()) *
+                sizeof(C);
+        }
+};
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+
+template<class T, class C>
+BSplineDomainCache<T, C>::BSplineDomainCache(size_t budget) :
+    s(new BSplineDomainCacheP<T, C>)
+{
+    s->budget = budget;
+    s->used = 0;
+    s->hits = s->misses = s->evictions = 0;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> BSplineDomainCache<T, C>::~BSplineDomainCache()
+{
+    delete s;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+BSplineDomainCache<T, C> &BSplineDomainCache<T, C>::instance()
+{
+    static BSplineDomainCache cache;
+    return cache;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+std::shared_ptr<const BSplineBase<T, C> >
+BSplineDomainCache<T, C>::domain(const T *x,
+                                 int nx,
+                                 double wl,
+                                 int bc,
+                                 int num_nodes)
+{
+    typedef BSplineDomainCacheP<T, C> P;
+    // setDomain() rejects these without keeping the x values, so they
+    // cannot be matched later.
+    if (nx <= 0 || x == 0 || wl < 0 || bc < 0 || bc > 2)
+        return std::shared_ptr<const BaseT>(new BaseT(x, nx, wl, bc,
+                                                      num_nodes));
+    uint64_t h = P::hash(x, nx, wl, bc, num_nodes);
+    {
+        std::lock_guard<std::mutex> guard(s->lock);
+        std::shared_ptr<const BaseT> d = s->find(h, x, nx, wl, bc,
+                                                 num_nodes);
+        if (d) {
+            ++s->hits;
+            return d;
+        }
+        ++s->misses;
+    }
+
+    // Set up the domain without holding the lock, so other lookups
+    // need not wait for it.
+    BaseT *b = new BaseT(x, nx, wl, bc, num_nodes);
+    std::shared_ptr<const BaseT> d(b);
+
+    typename P::Entry e;
+    e.hash = h;
+    e.nx = nx;
+    e.wl = wl;
+    e.bc = bc;
+    e.num_nodes = num_nodes;
+    e.bytes = P::bytes(*b);
+    e.domain = d;
+
+    std::lock_guard<std::mutex> guard(s->lock);
+    if (e.bytes > s->budget)
+        return d;
+
+    // Another thread may have set up the same domain meanwhile.
+    std::shared_ptr<const BaseT> other = s->find(h, x, nx, wl, bc,
+                                                 num_nodes);
+    if (other)
+        return other;
+    s->evict(s->budget - e.bytes);
+    s->lru.push_front(e);
+    s->index.insert(std::make_pair(h, s->lru.begin()));
+    s->used += e.bytes;
+    return d;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> void BSplineDomainCache<T, C>::setBudget(size_t b)
+{
+    std::lock_guard<std::mutex> guard(s->lock);
+    s->budget = b;
+    s->evict(b);
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> size_t BSplineDomainCache<T, C>::budget() const
+{
+    std::lock_guard<std::mutex> guard(s->lock);
+    return s->budget;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> size_t BSplineDomainCache<T, C>::memoryUsed() const
+{
+    std::lock_guard<std::mutex> guard(s->lock);
+    return s->used;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> size_t BSplineDomainCache<T, C>::size() const
+{
+    std::lock_guard<std::mutex> guard(s->lock);
+    return s->lru.size();
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+unsigned long BSplineDomainCache<T, C>::hits() const
+{
+    std::lock_guard<std::mutex> guard(s->lock);
+    return s->hits;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+unsigned long BSplineDomainCache<T, C>::misses() const
+{
+    std::lock_guard<std::mutex> guard(s->lock);
+    return s->misses;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+unsigned long BSplineDomainCache<T, C>::evictions() const
+{
+    std::lock_guard<std::mutex> guard(s->lock);
+    return s->evictions;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> void BSplineDomainCache<T, C>::clear()
+{
+    std::lock_guard<std::mutex> guard(s->lock);
+    s->lru.clear();
+    s->index.clear();
+    s->used = 0;
+    s->hits = s->misses = s->evictions = 0;
+}
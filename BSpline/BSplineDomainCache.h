@@ -0,0 +1,119 @@
+/* -*- mode: c++; c-basic-offset: 4; -*- */
+/************************************************************************
+ * Copyright 2009 University Corporation for Atmospheric Research.
+ * All rights reserved.
+ *
+ * Use of this code is subject to the standard BSD license:
+ *
+ *  http://www.opensource.org/licenses/bsd-license.html
+ *
+ * See the COPYRIGHT file in the source distribution for the license text,
+ * or see this web page:
+ *
+ *  http://www.eol.ucar.edu/homes/granger/bspline/doc/
+ *
+ *************************************************************************/
+
+#ifndef BSPLINEDOMAINCACHE_H
+#define BSPLINEDOMAINCACHE_H
+
+#include <BSpline/BSplineBase.h>
+
+#include <memory>
+#include <cstddef>
+
+template <class T, class C> struct BSplineDomainCacheP;
+
+
+/**
+ * A process-wide cache of factored BSplineBase domains, for programs
+ * which smooth many data sets sampled at the same x values.
+ *
+ * Looking up a domain hashes the x values together with the cutoff
+ * wavelength, boundary condition type, and number of nodes.  If a domain
+ * with exactly the same parameters and x values is cached, it is shared
+ * instead of running setDomain() again.  Otherwise a new domain is set
+ * up, cached, and returned.  The domains are shared as const objects, so
+ * they can be used to construct BSpline objects or to call solveMany(),
+ * but not changed.  Domains which fail to set up are cached too, so
+ * check ok() on the result.
+ *
+ * The cache holds domains up to a budget of memory, evicting the least
+ * recently used domains first.  Evicting a domain only releases the
+ * cache's reference to it.  The counters of hits, misses, and evictions
+ * help size the budget.  The cache can be used from several threads.
+ *
+ * @verbatim
+
+    BSplineDomainCache<float> &cache = BSplineDomainCache<float>::instance();
+    std::shared_ptr<const BSplineBase<float> > domain =
+        cache.domain(x, nx, wl, BSplineBase<float>::BC_ZERO_SECOND);
+    if (domain->ok())
+    {
+        BSpline<float> spline(*domain, y);
+        ...
+    }
+
+   @endverbatim
+ */
+template <class T, class C = T>
+class BSPLINE_PUBLIC BSplineDomainCache
+{
+public:
+    typedef BSplineBase<T, C> BaseT;
+
+    /// Return the cache shared by the whole process.
+    static BSplineDomainCache &instance ();
+
+    /**
+     * Create an empty cache with the given memory @p budget in bytes.
+     * Most programs should use instance() instead.
+     */
+    explicit BSplineDomainCache (size_t budget = 64 << 20);
+
+    /**
+     * Return the domain for the given parameters, which are the same as
+     * for BSplineBase::setDomain(), from the cache if possible.
+     */
+    std::shared_ptr<const BaseT>
+    domain (const T *x, int nx, double wl,
+	    int bc_type = BaseT::BC_ZERO_SECOND, int num_nodes = 0);
+
+    /**
+     * Change the memory budget in bytes, evicting domains if needed.  A
+     * domain larger than the whole budget is returned but never cached.
+     */
+    void setBudget (size_t budget);
+
+    /// Return the memory budget in bytes.
+    size_t budget () const;
+
+    /// Return the approximate memory used by the cached domains.
+    size_t memoryUsed () const;
+
+    /// Return the number of cached domains.
+    size_t size () const;
+
+    /// Return the number of lookups which found a cached domain.
+    unsigned long hits () const;
+
+    /// Return the number of lookups which had to set up a domain.
+    unsigned long misses () const;
+
+    /// Return the number of domains evicted to stay within the budget.
+    unsigned long evictions () const;
+
+    /// Remove all of the domains from the cache and reset the counters.
+    void clear ();
+
+    ~BSplineDomainCache ();
+
+private:
+    // The cache cannot be copied.
+    BSplineDomainCache (const BSplineDomainCache &);
+    BSplineDomainCache &operator= (const BSplineDomainCache &);
+
+    BSplineDomainCacheP<T, C> *s;
+};
+
+#endif
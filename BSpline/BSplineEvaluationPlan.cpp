@@ -0,0 +1,166 @@
+// -*- mode: c++; c-basic-offset: 4; -*-
+/************************************************************************
+ * Copyright 2009 University Corporation for Atmospheric Research.
+ * All rights reserved.
+ *
+ * Use of this code is subject to the standard BSD license:
+ *
+ *  http://www.opensource.org/licenses/bsd-license.html
+ *
+ * See the COPYRIGHT file in the source distribution for the license text,
+ * or see this web page:
+ *
+ *  http://www.eol.ucar.edu/homes/granger/bspline/doc/
+ *
+ *************************************************************************/
+
+/**
+ * @file
+ *
+ * This file defines the implementation for the BSplineEvaluationPlan
+ * template.
+ **/
+#include "BSplineEvaluationPlan.h"
+
+#include <vector>
+#include <algorithm>
+
+
+//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+// BSplineEvaluationPlan Class
+//////////////////////////////////////////////////////////////////////
+
+template<class T, class C> struct BSplineEvaluationPlanP
+{
+        BSplineEvaluationPlanP() : ok(false), n(0), nodes(0) {}
+
+        bool ok;
+        int n;          // Number of output x values
+        int nodes;      // Number of nodes of the planned domain
+
+        // For each output x, the first of the four consecutive nodes
+        // which reach it, and the weights of those nodes.
+        std::vector<int> Start;
+        std::vector<C> Weights;
+
+        // The number of output x values evaluated for every curve before
+        // moving on to the next block, so the weights of a block stay in
+        // cache across the curves.
+        enum { BLOCK = 512 };
+
+        /*
+         * Evaluate the curve with coefficients @p a and @p mean at output
+         * x values i0 through i1-1.  Domains with fewer than four nodes
+         * have zero weights past the last node, so their coefficients
+         * are padded to four.
+         */
+        template <class U>
+        void gather(const U *a, T mean, T *y, int i0, int i1) const
+        {
+            U pad[4] = { 0, 0, 0, 0 };
+            if (nodes < 4) {
+                std::copy(a, a + nodes, pad);
+                a = pad;
+            }
+            const C *w = &Weights[4*(size_t)i0];
+            for (int i = i0; i < i1; ++i, w += 4) {
+                const U *ai = a + Start[i];
+                C sum = ai[0] * w[0];
+                sum += ai[1] * w[1];
+                sum += ai[2] * w[2];
+                sum += ai[3] * w[3];
+                y[i] = sum + mean;
+            }
+        }
+};
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+
+template<class T, class C>
+BSplineEvaluationPlan<T, C>::BSplineEvaluationPlan(const BaseT &base,
+                                                   const T *x,
+                                                   int n) :
+    s(new BSplineEvaluationPlanP<T, C>)
+{
+    if (!base.ok() || n < 0 || (n > 0 && x == 0))
+        return;
+    s->ok = true;
+    s->n = n;
+    s->nodes = base.nNodes();
+    s->Start.resize(n);
+    s->Weights.resize(4*(size_t)n);
+
+    // Outside the domain, these are the same basis functions as
+    // BSpline::evaluate() sums.
+    for (int i = 0; i < n; ++i)
+        s->Start[i] = base.basisWeightsAt(x[i], &s->Weights[4*(size_t)i]);
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+BSplineEvaluationPlan<T, C>::BSplineEvaluationPlan
+(const BSplineEvaluationPlan &p) :
+    s(new BSplineEvaluationPlanP<T, C>(*p.s))
+{
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+BSplineEvaluationPlan<T, C> &
+BSplineEvaluationPlan<T, C>::operator=(const BSplineEvaluationPlan &p)
+{
+    if (this != &p)
+        *s = *p.s;
+    return *this;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+BSplineEvaluationPlan<T, C>::~BSplineEvaluationPlan()
+{
+    delete s;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> bool BSplineEvaluationPlan<T, C>::ok() const
+{
+    return s->ok;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> int BSplineEvaluationPlan<T, C>::size() const
+{
+    return s->n;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> int BSplineEvaluationPlan<T, C>::nNodes() const
+{
+    return s->nodes;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+bool BSplineEvaluationPlan<T, C>::execute(const BSpline<T, C> &spline,
+                                          T *y) const
+{
+    if (!s->ok || !spline.ok() || spline.nNodes() != s->nodes)
+        return false;
+    s->gather(&spline.s->A[0], spline.mean, y, 0, s->n);
+    return true;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C>
+bool BSplineEvaluationPlan<T, C>::execute(const T *coeffs,
+                                          int ncurves,
+                                          const T *means,
+                                          T *y) const
+{
+    if (!s->ok || coeffs == 0 || ncurves < 0)
+        return false;
+    const int n = s->n;
+    const int BLOCK = BSplineEvaluationPlanP<T, C>::BLOCK;
+    for (int i0 = 0; i0 < n; i0 += BLOCK) {
+        int i1 = std::min(n, i0 + BLOCK);
+        for (int c = 0; c < ncurves; ++c)
+            s->gather(coeffs + (size_t)c * s->nodes, means ? means[c] : 0,
+                      y + (size_t)c * n, i0, i1);
+    }
+    return true;
+}
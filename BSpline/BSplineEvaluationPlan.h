@@ -0,0 +1,106 @@
+/* -*- mode: c++; c-basic-offset: 4; -*- */
+/************************************************************************
+ * Copyright 2009 University Corporation for Atmospheric Research.
+ * All rights reserved.
+ *
+ * Use of this code is subject to the standard BSD license:
+ *
+ *  http://www.opensource.org/licenses/bsd-license.html
+ *
+ * See the COPYRIGHT file in the source distribution for the license text,
+ * or see this web page:
+ *
+ *  http://www.eol.ucar.edu/homes/granger/bspline/doc/
+ *
+ *************************************************************************/
+
+#ifndef BSPLINEEVALUATIONPLAN_H
+#define BSPLINEEVALUATIONPLAN_H
+
+#include <BSpline/BSpline.h>
+
+template <class T, class C> struct BSplineEvaluationPlanP;
+
+
+/**
+ * A plan for evaluating many curves over the same domain at the same
+ * output x values.
+ *
+ * The node interval of each output x and the weights of the basis
+ * functions there depend only on the domain and on x, not on the
+ * curve.  The plan finds them once, as the first of four consecutive
+ * nodes and their four weights with the boundary conditions folded in,
+ * so evaluating a curve is only a gather and a weighted sum per output
+ * x.  Output x values outside the domain are planned too, and every
+ * result agrees with BSpline::evaluate() to within rounding.
+ *
+ * @verbatim
+
+    BSplineBase<float> domain(x, nx, wl);
+    BSplineEvaluationPlan<float> plan(domain, xout, nout);
+    for (...)
+    {
+        BSpline<float> spline(domain, y);
+        plan.execute(spline, yout);
+        ...
+    }
+
+   @endverbatim
+ *
+ * The coefficients from BSplineBase::solveMany() can be evaluated as a
+ * block with the other form of execute(), which reads the weights of
+ * each output x once for all of the curves.
+ */
+template <class T, class C = T>
+class BSPLINE_PUBLIC BSplineEvaluationPlan
+{
+public:
+    typedef BSplineBase<T, C> BaseT;
+
+    /**
+     * Plan the evaluation of curves over @p base at the @p n values in
+     * @p x.  The plan is not ok() if the domain is not ok().
+     */
+    BSplineEvaluationPlan (const BaseT &base, const T *x, int n);
+
+    /// Copy the plan of @p p.
+    BSplineEvaluationPlan (const BSplineEvaluationPlan &p);
+
+    /// Copy the plan of @p p.
+    BSplineEvaluationPlan &operator= (const BSplineEvaluationPlan &p);
+
+    /// Return true if the plan was made for a domain which is ok().
+    bool ok () const;
+
+    /// Return the number of output x values.
+    int size () const;
+
+    /// Return the number of nodes of the planned domain.
+    int nNodes () const;
+
+    /**
+     * Evaluate @p spline at each planned x and store the results in @p
+     * y.  Returns false, and leaves @p y alone, if the plan or the
+     * spline is not ok() or the spline has a different number of nodes
+     * than the planned domain.
+     */
+    bool execute (const BSpline<T, C> &spline, T *y) const;
+
+    /**
+     * Evaluate @p ncurves curves from their coefficients, in the layout
+     * of BSplineBase::solveMany(), curve @p c starting at
+     * coeffs[c*nNodes()].  The means, if not null, are added to the
+     * curves as in solveMany().  The results for curve @p c are stored
+     * in y[c*size()] through y[c*size() + size() - 1].  Returns false if
+     * the plan is not ok().
+     */
+    bool execute (const T *coeffs, int ncurves, const T *means,
+		  T *y) const;
+
+    ~BSplineEvaluationPlan ();
+
+private:
+    BSplineEvaluationPlanP<T, C> *s;
+};
+
+#endif
@@ -0,0 +1,606 @@
+/* -*- mode: c++; c-basic-offset: 4; -*- */
+/************************************************************************
+ * Copyright 2009 University Corporation for Atmospheric Research.
+ * All rights reserved.
+ *
+ * Use of this code is subject to the standard BSD license:
+ *
+ *  http://www.opensource.org/licenses/bsd-license.html
+ *
+ * See the COPYRIGHT file in the source distribution for the license text,
+ * or see this web page:
+ *
+ *  http://www.eol.ucar.edu/homes/granger/bspline/doc/
+ *
+ *************************************************************************/
+
+/**
+ * @file
+ *
+ * Kernels for evaluating a cubic b-spline over arrays of x values, and
+ * for scanning the x values of a domain.  These are private to the
+ * BSpline implementation.
+ *
+ * Within node interval n, at the fraction t of the way from node n to
+ * node n+1, only the basis functions of nodes n-1 through n+2 are
+ * nonzero, and their weights have a closed form in t.  The weights are
+ * normalized like BSplineBase::Basis(), where the weight at a node is 1.
+ * The kernels evaluate the curve from an extended coefficient array E,
+ * where E[n+k] is the coefficient of node n-1+k, and the coefficients of
+ * the virtual nodes -1 and M+1 already fold in the boundary conditions.
+ * Every x is clamped into the domain, so callers must handle any x
+ * outside of it separately.
+ *
+ * The vector kernels use SSE2, or AVX2 when the compiler enables it
+ * (eg, -mavx2 -mfma).  Define BSPLINE_NO_SIMD to use only the scalar
+ * kernel.
+ **/
+#ifndef _BSPLINEKERNELS_H_
+#define _BSPLINEKERNELS_H_
+
+#if !defined(BSPLINE_NO_SIMD)
+#if defined(__AVX2__)
+#define BSPLINE_AVX2 1
+#define BSPLINE_SSE2 1
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BSPLINE_SSE2 1
+#include <emmintrin.h>
+#endif
+#endif
+
+
+/*
+ * Each lane type provides the arithmetic the kernel loop needs, so the
+ * same loop serves the scalar and vector cases.  V holds the values and
+ * I the interval indices of one group of lanes.
+ */
+template <class T> struct BSplineLane
+{
+    typedef T V;
+    typedef int I;
+    enum { width = 1 };
+
+    static inline V load (const T *p) { return *p; }
+    static inline void store (T *p, V v) { *p = v; }
+    static inline V set1 (T a) { return a; }
+    static inline V add (V a, V b) { return a + b; }
+    static inline V sub (V a, V b) { return a - b; }
+    static inline V mul (V a, V b) { return a * b; }
+    static inline V madd (V a, V b, V c) { return a * b + c; }
+    static inline V min (V a, V b) { return (a < b) ? a : b; }
+    static inline V max (V a, V b) { return (a > b) ? a : b; }
+    static inline V clamp (V a, V lo, V hi)
+    {
+	return (a < lo) ? lo : ((a > hi) ? hi : a);
+    }
+    static inline I index (V u, V last)
+    {
+	return (int)((u < last) ? u : last);
+    }
+    static inline V convert (I i) { return (T)i; }
+    static inline V gather (const T *e, I i) { return e[i]; }
+};
+
+
+#if defined(BSPLINE_SSE2)
+
+struct BSplineLaneSSE2d
+{
+    typedef __m128d V;
+    typedef __m128i I;
+    enum { width = 2 };
+
+    static inline V load (const double *p) { return _mm_loadu_pd(p); }
+    static inline void store (double *p, V v) { _mm_storeu_pd(p, v); }
+    static inline V set1 (double a) { return _mm_set1_pd(a); }
+    static inline V add (V a, V b) { return _mm_add_pd(a, b); }
+    static inline V sub (V a, V b) { return _mm_sub_pd(a, b); }
+    static inline V mul (V a, V b) { return _mm_mul_pd(a, b); }
+    static inline V madd (V a, V b, V c)
+    {
+	return _mm_add_pd(_mm_mul_pd(a, b), c);
+    }
+    static inline V min (V a, V b) { return _mm_min_pd(a, b); }
+    static inline V max (V a, V b) { return _mm_max_pd(a, b); }
+    static inline V clamp (V a, V lo, V hi)
+    {
+	return _mm_min_pd(_mm_max_pd(a, lo), hi);
+    }
+    static inline I index (V u, V last)
+    {
+	return _mm_cvttpd_epi32(_mm_min_pd(u, last));
+    }
+    static inline V convert (I i) { return _mm_cvtepi32_pd(i); }
+    static inline V gather (const double *e, I i)
+    {
+	return _mm_set_pd(e[_mm_cvtsi128_si32(_mm_srli_si128(i, 4))],
+			  e[_mm_cvtsi128_si32(i)]);
+    }
+};
+
+struct BSplineLaneSSE2f
+{
+    typedef __m128 V;
+    typedef __m128i I;
+    enum { width = 4 };
+
+    static inline V load (const float *p) { return _mm_loadu_ps(p); }
+    static inline void store (float *p, V v) { _mm_storeu_ps(p, v); }
+    static inline V set1 (float a) { return _mm_set1_ps(a); }
+    static inline V add (V a, V b) { return _mm_add_ps(a, b); }
+    static inline V sub (V a, V b) { return _mm_sub_ps(a, b); }
+    static inline V mul (V a, V b) { return _mm_mul_ps(a, b); }
+    static inline V madd (V a, V b, V c)
+    {
+	return _mm_add_ps(_mm_mul_ps(a, b), c);
+    }
+    static inline V min (V a, V b) { return _mm_min_ps(a, b); }
+    static inline V max (V a, V b) { return _mm_max_ps(a, b); }
+    static inline V clamp (V a, V lo, V hi)
+    {
+	return _mm_min_ps(_mm_max_ps(a, lo), hi);
+    }
+    static inline I index (V u, V last)
+    {
+	return _mm_cvttps_epi32(_mm_min_ps(u, last));
+    }
+    static inline V convert (I i) { return _mm_cvtepi32_ps(i); }
+    static inline V gather (const float *e, I i)
+    {
+	return _mm_set_ps(e[_mm_cvtsi128_si32(_mm_srli_si128(i, 12))],
+			  e[_mm_cvtsi128_si32(_mm_srli_si128(i, 8))],
+			  e[_mm_cvtsi128_si32(_mm_srli_si128(i, 4))],
+			  e[_mm_cvtsi128_si32(i)]);
+    }
+};
+
+#endif /* BSPLINE_SSE2 */
+
+
+#if defined(BSPLINE_AVX2)
+
+struct BSplineLaneAVX2d
+{
+    typedef __m256d V;
+    typedef __m128i I;
+    enum { width = 4 };
+
+    static inline V load (const double *p) { return _mm256_loadu_pd(p); }
+    static inline void store (double *p, V v) { _mm256_storeu_pd(p, v); }
+    static inline V set1 (double a) { return _mm256_set1_pd(a); }
+    static inline V add (V a, V b) { return _mm256_add_pd(a, b); }
+    static inline V sub (V a, V b) { return _mm256_sub_pd(a, b); }
+    static inline V mul (V a, V b) { return _mm256_mul_pd(a, b); }
+    static inline V madd (V a, V b, V c)
+    {
+#if defined(__FMA__)
+	return _mm256_fmadd_pd(a, b, c);
+#else
+	return _mm256_add_pd(_mm256_mul_pd(a, b), c);
+#endif
+    }
+    static inline V min (V a, V b) { return _mm256_min_pd(a, b); }
+    static inline V max (V a, V b) { return _mm256_max_pd(a, b); }
+    static inline V clamp (V a, V lo, V hi)
+    {
+	return _mm256_min_pd(_mm256_max_pd(a, lo), hi);
+    }
+    static inline I index (V u, V last)
+    {
+	return _mm256_cvttpd_epi32(_mm256_min_pd(u, last));
+    }
+    static inline V convert (I i) { return _mm256_cvtepi32_pd(i); }
+    static inline V gather (const double *e, I i)
+    {
+	// The masked form avoids reading an undefined source register.
+	return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), e, i,
+	    _mm256_castsi256_pd(_mm256_set1_epi64x(-1)), 8);
+    }
+};
+
+struct BSplineLaneAVX2f
+{
+    typedef __m256 V;
+    typedef __m256i I;
+    enum { width = 8 };
+
+    static inline V load (const float *p) { return _mm256_loadu_ps(p); }
+    static inline void store (float *p, V v) { _mm256_storeu_ps(p, v); }
+    static inline V set1 (float a) { return _mm256_set1_ps(a); }
+    static inline V add (V a, V b) { return _mm256_add_ps(a, b); }
+    static inline V sub (V a, V b) { return _mm256_sub_ps(a, b); }
+    static inline V mul (V a, V b) { return _mm256_mul_ps(a, b); }
+    static inline V madd (V a, V b, V c)
+    {
+#if defined(__FMA__)
+	return _mm256_fmadd_ps(a, b, c);
+#else
+	return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+    }
+    static inline V min (V a, V b) { return _mm256_min_ps(a, b); }
+    static inline V max (V a, V b) { return _mm256_max_ps(a, b); }
+    static inline V clamp (V a, V lo, V hi)
+    {
+	return _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+    }
+    static inline I index (V u, V last)
+    {
+	return _mm256_cvttps_epi32(_mm256_min_ps(u, last));
+    }
+    static inline V convert (I i) { return _mm256_cvtepi32_ps(i); }
+    static inline V gather (const float *e, I i)
+    {
+	return _mm256_mask_i32gather_ps(_mm256_setzero_ps(), e, i,
+	    _mm256_castsi256_ps(_mm256_set1_epi32(-1)), 4);
+    }
+};
+
+#endif /* BSPLINE_AVX2 */
+
+
+/*
+ * The weights of nodes n-1 through n+2 for the D-th derivative with
+ * respect to t, for D of 0, 1, or 2.
+ */
+template <class L, int D> struct BSplineWeights;
+
+template <class L> struct BSplineWeights<L, 0>
+{
+    typedef typename L::V V;
+    static inline void get (V t, V *w)
+    {
+	V s = L::sub(L::set1(1), t);
+	V t2 = L::mul(t, t);
+	V t3 = L::mul(t2, t);
+	w[0] = L::mul(L::set1(0.25), L::mul(L::mul(s, s), s));
+	w[1] = L::madd(L::set1(0.75), t3,
+		       L::madd(L::set1(-1.5), t2, L::set1(1)));
+	w[2] = L::madd(L::set1(0.75), L::sub(L::add(t, t2), t3),
+		       L::set1(0.25));
+	w[3] = L::mul(L::set1(0.25), t3);
+    }
+};
+
+template <class L> struct BSplineWeights<L, 1>
+{
+    typedef typename L::V V;
+    static inline void get (V t, V *w)
+    {
+	V s = L::sub(L::set1(1), t);
+	V t2 = L::mul(t, t);
+	w[0] = L::mul(L::set1(-0.75), L::mul(s, s));
+	w[1] = L::madd(L::set1(2.25), t2, L::mul(L::set1(-3), t));
+	w[2] = L::madd(L::set1(-2.25), t2,
+		       L::madd(L::set1(1.5), t, L::set1(0.75)));
+	w[3] = L::mul(L::set1(0.75), t2);
+    }
+};
+
+template <class L> struct BSplineWeights<L, 2>
+{
+    typedef typename L::V V;
+    static inline void get (V t, V *w)
+    {
+	V s = L::sub(L::set1(1), t);
+	w[0] = L::mul(L::set1(1.5), s);
+	w[1] = L::madd(L::set1(4.5), t, L::set1(-3));
+	w[2] = L::madd(L::set1(-4.5), t, L::set1(1.5));
+	w[3] = L::mul(L::set1(1.5), t);
+    }
+};
+
+
+/*
+ * Evaluate the D-th derivative of the curve with extended coefficients @p
+ * E over M node intervals starting at @p xmin, with @p rdx the inverse of
+ * the interval length.  Each result is multiplied by @p scale and then @p
+ * offset is added.  Returns the number of x values handled, a multiple of
+ * the lane width no greater than @p n.
+ */
+template <class L, int D, class T>
+inline int
+bspline_evaluate_lanes (const T *E, int M, T xmin, T rdx, T scale, T offset,
+			const T *x, int n, T *y)
+{
+    typedef typename L::V V;
+    typedef typename L::I I;
+    const V vxmin = L::set1(xmin);
+    const V vrdx = L::set1(rdx);
+    const V vzero = L::set1(0);
+    const V vM = L::set1((T)M);
+    const V vlast = L::set1((T)(M-1));
+    const V vscale = L::set1(scale);
+    const V voffset = L::set1(offset);
+    V w[4];
+    int i;
+    for (i = 0; i + (int)L::width <= n; i += L::width)
+    {
+	V u = L::clamp(L::mul(L::sub(L::load(x + i), vxmin), vrdx),
+		       vzero, vM);
+	I k = L::index(u, vlast);
+	V t = L::sub(u, L::convert(k));
+	BSplineWeights<L, D>::get(t, w);
+	V sum = L::mul(L::gather(E, k), w[0]);
+	sum = L::madd(L::gather(E + 1, k), w[1], sum);
+	sum = L::madd(L::gather(E + 2, k), w[2], sum);
+	sum = L::madd(L::gather(E + 3, k), w[3], sum);
+	L::store(y + i, L::madd(sum, vscale, voffset));
+    }
+    return i;
+}
+
+
+/*
+ * Evaluate the curve and its first two derivatives together, as in
+ * bspline_evaluate_lanes(), sharing the interval lookup and the gathered
+ * coefficients.  The value is offset by @p offset, and the derivatives
+ * are scaled by @p rdx and its square.  @p d2y may be null.
+ */
+template <class L, class T>
+inline int
+bspline_derivatives_lanes (const T *E, int M, T xmin, T rdx, T offset,
+			   const T *x, int n, T *y, T *dy, T *d2y)
+{
+    typedef typename L::V V;
+    typedef typename L::I I;
+    const V vxmin = L::set1(xmin);
+    const V vrdx = L::set1(rdx);
+    const V vrdx2 = L::set1(rdx * rdx);
+    const V vzero = L::set1(0);
+    const V vM = L::set1((T)M);
+    const V vlast = L::set1((T)(M-1));
+    const V voffset = L::set1(offset);
+    V w[4], e[4];
+    int i;
+    for (i = 0; i + (int)L::width <= n; i += L::width)
+    {
+	V u = L::clamp(L::mul(L::sub(L::load(x + i), vxmin), vrdx),
+		       vzero, vM);
+	I k = L::index(u, vlast);
+	V t = L::sub(u, L::convert(k));
+	e[0] = L::gather(E, k);
+	e[1] = L::gather(E + 1, k);
+	e[2] = L::gather(E + 2, k);
+	e[3] = L::gather(E + 3, k);
+
+	BSplineWeights<L, 0>::get(t, w);
+	V sum = L::mul(e[0], w[0]);
+	sum = L::madd(e[1], w[1], sum);
+	sum = L::madd(e[2], w[2], sum);
+	sum = L::madd(e[3], w[3], sum);
+	L::store(y + i, L::add(sum, voffset));
+
+	BSplineWeights<L, 1>::get(t, w);
+	sum = L::mul(e[0], w[0]);
+	sum = L::madd(e[1], w[1], sum);
+	sum = L::madd(e[2], w[2], sum);
+	sum = L::madd(e[3], w[3], sum);
+	L::store(dy + i, L::mul(sum, vrdx));
+
+	if (d2y)
+	{
+	    BSplineWeights<L, 2>::get(t, w);
+	    sum = L::mul(e[0], w[0]);
+	    sum = L::madd(e[1], w[1], sum);
+	    sum = L::madd(e[2], w[2], sum);
+	    sum = L::madd(e[3], w[3], sum);
+	    L::store(d2y + i, L::mul(sum, vrdx2));
+	}
+    }
+    return i;
+}
+
+
+/*
+ * Run the widest vector kernel available for type T over as many of the
+ * x values as fill whole vectors, and return how many were done.
+ */
+template <int D, class T>
+inline int
+bspline_evaluate_simd (const T *, int, T, T, T, T, const T *, int, T *)
+{
+    return 0;
+}
+
+#if defined(BSPLINE_SSE2)
+
+template <int D>
+inline int
+bspline_evaluate_simd (const double *E, int M, double xmin, double rdx,
+		       double scale, double offset,
+		       const double *x, int n, double *y)
+{
+#if defined(BSPLINE_AVX2)
+    return bspline_evaluate_lanes<BSplineLaneAVX2d, D>
+	(E, M, xmin, rdx, scale, offset, x, n, y);
+#else
+    return bspline_evaluate_lanes<BSplineLaneSSE2d, D>
+	(E, M, xmin, rdx, scale, offset, x, n, y);
+#endif
+}
+
+template <int D>
+inline int
+bspline_evaluate_simd (const float *E, int M, float xmin, float rdx,
+		       float scale, float offset,
+		       const float *x, int n, float *y)
+{
+#if defined(BSPLINE_AVX2)
+    return bspline_evaluate_lanes<BSplineLaneAVX2f, D>
+	(E, M, xmin, rdx, scale, offset, x, n, y);
+#else
+    return bspline_evaluate_lanes<BSplineLaneSSE2f, D>
+	(E, M, xmin, rdx, scale, offset, x, n, y);
+#endif
+}
+
+#endif /* BSPLINE_SSE2 */
+
+
+template <class T>
+inline int
+bspline_derivatives_simd (const T *, int, T, T, T, const T *, int,
+			  T *, T *, T *)
+{
+    return 0;
+}
+
+#if defined(BSPLINE_SSE2)
+
+inline int
+bspline_derivatives_simd (const double *E, int M, double xmin, double rdx,
+			  double offset, const double *x, int n,
+			  double *y, double *dy, double *d2y)
+{
+#if defined(BSPLINE_AVX2)
+    return bspline_derivatives_lanes<BSplineLaneAVX2d>
+	(E, M, xmin, rdx, offset, x, n, y, dy, d2y);
+#else
+    return bspline_derivatives_lanes<BSplineLaneSSE2d>
+	(E, M, xmin, rdx, offset, x, n, y, dy, d2y);
+#endif
+}
+
+inline int
+bspline_derivatives_simd (const float *E, int M, float xmin, float rdx,
+			  float offset, const float *x, int n,
+			  float *y, float *dy, float *d2y)
+{
+#if defined(BSPLINE_AVX2)
+    return bspline_derivatives_lanes<BSplineLaneAVX2f>
+	(E, M, xmin, rdx, offset, x, n, y, dy, d2y);
+#else
+    return bspline_derivatives_lanes<BSplineLaneSSE2f>
+	(E, M, xmin, rdx, offset, x, n, y, dy, d2y);
+#endif
+}
+
+#endif /* BSPLINE_SSE2 */
+
+
+/*
+ * Evaluate the D-th derivative at all @p n values of @p x, using the
+ * vector kernel for the bulk and the scalar kernel for the remainder.
+ */
+template <int D, class T>
+inline void
+bspline_evaluate (const T *E, int M, T xmin, T rdx, T scale, T offset,
+		  const T *x, int n, T *y)
+{
+    int i = bspline_evaluate_simd<D>(E, M, xmin, rdx, scale, offset,
+				     x, n, y);
+    bspline_evaluate_lanes<BSplineLane<T>, D>
+	(E, M, xmin, rdx, scale, offset, x + i, n - i, y + i);
+}
+
+/*
+ * Evaluate the curve and its first two derivatives at all @p n values of
+ * @p x, as in bspline_evaluate().
+ */
+template <class T>
+inline void
+bspline_derivatives (const T *E, int M, T xmin, T rdx, T offset,
+		     const T *x, int n, T *y, T *dy, T *d2y)
+{
+    int i = bspline_derivatives_simd(E, M, xmin, rdx, offset,
+				     x, n, y, dy, d2y);
+    bspline_derivatives_lanes<BSplineLane<T> >
+	(E, M, xmin, rdx, offset, x + i, n - i, y + i, dy + i,
+	 d2y ? d2y + i : 0);
+}
+
+/*
+ * Fold the values of @p x into @p lo and @p hi, as many as fill whole
+ * vectors, and return how many were done.
+ */
+template <class L, class T>
+inline int
+bspline_minmax_lanes (const T *x, int n, T &lo, T &hi)
+{
+    typedef typename L::V V;
+    if (n < (int)L::width)
+	return 0;
+    V vlo = L::load(x);
+    V vhi = vlo;
+    int i;
+    for (i = L::width; i + (int)L::width <= n; i += L::width)
+    {
+	V v = L::load(x + i);
+	vlo = L::min(vlo, v);
+	vhi = L::max(vhi, v);
+    }
+    T a[L::width];
+    T b[L::width];
+    L::store(a, vlo);
+    L::store(b, vhi);
+    for (int k = 0; k < (int)L::width; ++k)
+    {
+	lo = (a[k] < lo) ? a[k] : lo;
+	hi = (b[k] > hi) ? b[k] : hi;
+    }
+    return i;
+}
+
+template <class T>
+inline int
+bspline_minmax_simd (const T *, int, T &, T &)
+{
+    return 0;
+}
+
+#if defined(BSPLINE_SSE2)
+
+inline int
+bspline_minmax_simd (const double *x, int n, double &lo, double &hi)
+{
+#if defined(BSPLINE_AVX2)
+    return bspline_minmax_lanes<BSplineLaneAVX2d>(x, n, lo, hi);
+#else
+    return bspline_minmax_lanes<BSplineLaneSSE2d>(x, n, lo, hi);
+#endif
+}
+
+inline int
+bspline_minmax_simd (const float *x, int n, float &lo, float &hi)
+{
+#if defined(BSPLINE_AVX2)
+    return bspline_minmax_lanes<BSplineLaneAVX2f>(x, n, lo, hi);
+#else
+    return bspline_minmax_lanes<BSplineLaneSSE2f>(x, n, lo, hi);
+#endif
+}
+
+#endif /* BSPLINE_SSE2 */
+
+/*
+ * Find the minimum and maximum of the @p n values in @p x, where @p n is
+ * at least 1, in a single pass.
+ */
+template <class T>
+inline void
+bspline_minmax (const T *x, int n, T &lo, T &hi)
+{
+    lo = hi = x[0];
+    int i = bspline_minmax_simd(x, n, lo, hi);
+    bspline_minmax_lanes<BSplineLane<T> >(x + i, n - i, lo, hi);
+}
+
+/*
+ * Convert the four extended coefficients of a node interval, e[0] through
+ * e[3], into the coefficients of the cubic polynomial in t over that
+ * interval, p[0] + p[1]*t + p[2]*t^2 + p[3]*t^3.
+ */
+template <class T>
+inline void
+bspline_polynomial (const T *e, T *p)
+{
+    p[0] = (e[0] + 4*e[1] + e[2]) * (T)0.25;
+    p[1] = (e[2] - e[0]) * (T)0.75;
+    p[2] = (e[0] - 2*e[1] + e[2]) * (T)0.75;
+    p[3] = (3*(e[1] - e[2]) + e[3] - e[0]) * (T)0.25;
+}
+
+#endif /* _BSPLINEKERNELS_H_ */
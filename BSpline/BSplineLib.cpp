@@ -17,11 +17,31 @@
 
 #include "BSplineBase.cpp"
 #include "BSpline.cpp"
+#include "BSplineStream.cpp"
+#include "BSplineDomainCache.cpp"
+#include "BSplineEvaluationPlan.cpp"
 
 /// Instantiate BSplineBase for a library
 template class  BSplineBase<double>;
 template class  BSplineBase<float>;
+template class  BSplineBase<float, double>;
 
 /// Instantiate BSpline for a library
 template class BSpline<double>;
 template class BSpline<float>;
+template class BSpline<float, double>;
+
+/// Instantiate BSplineStream for a library
+template class BSplineStream<double>;
+template class BSplineStream<float>;
+template class BSplineStream<float, double>;
+
+/// Instantiate BSplineDomainCache for a library
+template class BSplineDomainCache<double>;
+template class BSplineDomainCache<float>;
+template class BSplineDomainCache<float, double>;
+
+/// Instantiate BSplineEvaluationPlan for a library
+template class BSplineEvaluationPlan<double>;
+template class BSplineEvaluationPlan<float>;
+template class BSplineEvaluationPlan<float, double>;
@@ -0,0 +1,365 @@
+// -*- mode: c++; c-basic-offset: 4; -*-
+/************************************************************************
+ * Copyright 2009 University Corporation for Atmospheric Research.
+ * All rights reserved.
+ *
+ * Use of this code is subject to the standard BSD license:
+ *
+ *  http://www.opensource.org/licenses/bsd-license.html
+ *
+ * See the COPYRIGHT file in the source distribution for the license text,
+ * or see this web page:
+ *
+ *  http://www.eol.ucar.edu/homes/granger/bspline/doc/
+ *
+ *************************************************************************/
+
+/**
+ * @file
+ *
+ * This file defines the implementation for the BSplineStream template.
+ **/
+#include "BSplineStream.h"
+#include "BandedMatrix.h"
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <iostream>
+
+
+//////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////
+// BSplineStream Class
+//////////////////////////////////////////////////////////////////////
+
+template<class T, class C> struct BSplineStreamP {
+        BSplineStreamP() :
+            offset(0), lag(0), klast(-1), xlast(0), first(0),
+            nfactored(0), cfirst(0), closed(false) {}
+
+        C offset;       // The first y value, removed from every y
+        int lag;        // Nodes between the newest factored row and the
+                        // coefficient fixed from it
+        int klast;      // Interval of the newest sample
+        T xlast;        // The newest sample
+        int first;      // Node of the first row kept in base->Q and Z
+        int nfactored;  // Rows before this node are factored
+
+        // The right-hand side of each row kept, replaced by the forward
+        // substitution through U' once the row is factored.
+        std::vector<C> Z;
+
+        // Scratch space for factoring and back substitution.
+        std::vector<C> V;
+        std::vector<C> W;
+
+        // The samples in the last two intervals, which are added to P+Q
+        // only once they cannot be in the last interval of the domain,
+        // where the right boundary condition changes the basis functions.
+        std::deque<T> PX;
+        std::deque<T> PY;
+
+        // The x values of the samples which have not been read yet.
+        std::deque<T> OX;
+
+        // The fixed coefficients, starting at node cfirst.
+        int cfirst;
+        std::deque<C> A;
+
+        bool closed;
+};
+
+//////////////////////////////////////////////////////////////////////
+// Construction/Destruction
+//////////////////////////////////////////////////////////////////////
+
+template<class T, class C> BSplineStream<T, C>::BSplineStream(T x0,
+                                                              double dx,
+                                                              double wl,
+                                                              int bc_type,
+                                                              int lag) :
+    BSplineBase<T, C>(), s(new BSplineStreamP<T, C>)
+{
+    if (!(dx > 0) || wl < 0 || bc_type < 0 || bc_type > 2 || lag < 0)
+        return;
+    xmin = xmax = x0;
+    DX = dx;
+    BC = bc_type;
+    waveLength = wl;
+    alpha = Alpha(wl);
+
+    // The right end of the domain is not known until finish(), so until
+    // then put it where no basis function or Q element can reach it.
+    M = std::numeric_limits<int>::max() / 2;
+
+    if (lag == 0)
+        lag = my::max(8, (int)std::ceil(2 * wl / dx));
+    s->lag = lag;
+    s->V.resize(3);
+    s->W.resize(2 * lag);
+
+    // Keep enough rows for the back substitution, plus room to add
+    // samples ahead of the factored rows before the rows must be moved.
+    int nrows = 3 * lag + 32;
+    this->solverType = BSplineBase<T, C>::SOLVER_LDLT;
+    base->Q.setup(nrows, 0, 3);
+    base->Q = 0;
+    s->Z.resize(nrows);
+    OK = true;
+    if (this->Debug())
+        std::cerr << "Streaming with node interval " << DX << ", alpha "
+                  << alpha << ", lag " << lag << " nodes." << std::endl;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> BSplineStream<T, C>::~BSplineStream()
+{
+    delete s;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> int BSplineStream<T, C>::lag()
+{
+    return s->lag;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Return the band storage of the row for node m, moving the rows which
+ * are still needed to the start of the storage, or enlarging it, when m
+ * is past the end.
+ */
+template<class T, class C> C *BSplineStream<T, C>::row(int m)
+{
+    Matrix<C> &U = base->Q;
+    int nrows = U.num_rows();
+    if (m - s->first >= nrows) {
+        // The back substitution reaches back to the next coefficient to
+        // be fixed, and factoring the next row reaches back 3 rows.
+        int nfixed = s->cfirst + s->A.size();
+        int keep = my::max(s->first, my::min(nfixed, s->nfactored - 3));
+        int shift = keep - s->first;
+        int ld = U.row_width();
+        int need = m - keep + 1;
+        std::vector<C> rows(U.storage() + (size_t)shift * ld,
+                            U.storage() + (size_t)nrows * ld);
+        std::vector<C> z(s->Z.begin() + shift, s->Z.end());
+        if (need > nrows) {
+            nrows = 2 * need;
+            U.setup(nrows, 0, 3);
+            s->Z.resize(nrows);
+        }
+        U = 0;
+        std::fill(s->Z.begin(), s->Z.end(), C());
+        std::copy(rows.begin(), rows.end(), U.storage());
+        std::copy(z.begin(), z.end(), s->Z.begin());
+        s->first = keep;
+    }
+    return U.storage() + (size_t)(m - s->first) * U.row_width();
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Add the sample (x, y) to P and to the right-hand side, as in addP()
+ * and BSpline::solve().
+ */
+template<class T, class C> void BSplineStream<T, C>::addSample(T x, T y)
+{
+    int mx = (int)((x - xmin) / DX);
+    int lo = my::max(0, mx-1);
+    int hi = my::min(M, mx+2);
+    row(hi);
+
+    Matrix<C> &P = base->Q;
+    C *Z = &s->Z[0];
+    int f = s->first;
+    C yj = y - s->offset;
+    double b[4];
+    int m, n;
+    for (m = lo; m <= hi; ++m)
+        b[m-lo] = Basis(m, x);
+    for (m = lo; m <= hi; ++m) {
+        C pm = b[m-lo];
+        Z[m-f] += yj * pm;
+        P.band(m-f, m-f) += pm * pm;
+        for (n = m+1; n <= hi; ++n) {
+            C pn = b[n-lo];
+            P.band(m-f, n-f) += pm * pn;
+        }
+    }
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Add Q to the next row, now that all of its P contributions are in,
+ * then factor it and forward substitute its right-hand side.
+ */
+template<class T, class C> bool BSplineStream<T, C>::factorRow()
+{
+    int m = s->nfactored;
+    row(my::min(m+3, M));
+
+    Matrix<C> &U = base->Q;
+    int f = s->first;
+    int i = m - f;
+    int j;
+    if (alpha != 0) {
+        C q[4];
+        qRow(m, q);
+        for (j = 0; j < 4 && m+j <= M; ++j)
+            U.band(i, i+j) += alpha * q[j];
+    }
+    int nrows = my::min((int)U.num_rows(), M+1 - f);
+    if (LDLT_factor_banded_row(U.storage(), U.row_width(), nrows, i, 3,
+                               &s->V[0]) != 0) {
+        if (this->Debug())
+            std::cerr << "LDLT_factor_banded_row() failed at node " << m
+                      << std::endl;
+        return false;
+    }
+
+    C *Z = &s->Z[0];
+    C sum = Z[i];
+    for (j = my::max(0, i-3); j < i; ++j)
+        sum -= U.band(j, i) * Z[j];
+    Z[i] = sum;
+    ++s->nfactored;
+    return true;
+}
+//////////////////////////////////////////////////////////////////////
+/*
+ * Once the newest factored row is 2*lag nodes past the next coefficient
+ * to be fixed, back substitute from it as if the stream ended there, and
+ * fix the lag coefficients which have at least lag nodes ahead of them.
+ * Each pass costs O(lag) and fixes lag coefficients, so the work per
+ * node is constant.
+ */
+template<class T, class C> void BSplineStream<T, C>::solveLag()
+{
+    int last = s->nfactored - 1;
+    int n = s->cfirst + s->A.size();
+    int lag = s->lag;
+    if (last - n + 1 < 2 * lag)
+        return;
+
+    Matrix<C> &U = base->Q;
+    const C *Z = &s->Z[0];
+    C *W = &s->W[0];
+    int f = s->first;
+    for (int i = last; i >= n; --i) {
+        C sum = Z[i-f] / U.band(i-f, i-f);
+        for (int j = i+1; j <= last && j <= i+3; ++j)
+            sum -= U.band(i-f, j-f) * W[j-n];
+        W[i-n] = sum;
+    }
+    s->A.insert(s->A.end(), W, W + lag);
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> bool BSplineStream<T, C>::add(T x, T y)
+{
+    if (!OK || s->closed)
+        return false;
+    if (x < xmin || (s->klast >= 0 && x < s->xlast))
+        return false;
+
+    if (s->klast < 0)
+        s->offset = y;
+    int k = (int)((x - xmin) / DX);
+    if (k > s->klast) {
+        // The domain ends at node k or later, so the samples before
+        // interval k-1 are now clear of the right boundary.
+        while (!s->PX.empty() && (int)((s->PX.front() - xmin) / DX) < k-1) {
+            addSample(s->PX.front(), s->PY.front());
+            s->PX.pop_front();
+            s->PY.pop_front();
+        }
+        s->klast = k;
+
+        // Later samples only reach rows from k-1 on, and the right
+        // boundary condition only reaches rows from M-4 on, where M is
+        // at least k, so the rows up to k-5 are complete.
+        while (s->nfactored <= k-5) {
+            if (!factorRow()) {
+                OK = false;
+                return false;
+            }
+            solveLag();
+        }
+    }
+    s->xlast = xmax = x;
+    s->PX.push_back(x);
+    s->PY.push_back(y);
+    s->OX.push_back(x);
+    return true;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> bool BSplineStream<T, C>::finish()
+{
+    if (!OK || s->closed)
+        return false;
+    s->closed = true;
+    if (s->klast < 0) {
+        OK = false;
+        return false;
+    }
+
+    // Now the end of the domain is known, so the remaining samples and
+    // rows get the right boundary condition.  As in Setup(), a last
+    // sample which falls on a node ends the domain there.
+    M = s->klast + 1;
+    if (s->klast > 0 && (s->xlast - xmin) / DX == s->klast)
+        M = s->klast;
+    for (size_t i = 0; i < s->PX.size(); ++i)
+        addSample(s->PX[i], s->PY[i]);
+    s->PX.clear();
+    s->PY.clear();
+    while (s->nfactored <= M) {
+        if (!factorRow()) {
+            OK = false;
+            return false;
+        }
+    }
+
+    // Back substitute the rest of the coefficients exactly.
+    int n = s->cfirst + s->A.size();
+    if (n <= M) {
+        Matrix<C> &U = base->Q;
+        const C *Z = &s->Z[0];
+        int f = s->first;
+        std::vector<C> W(M+1 - n);
+        for (int i = M; i >= n; --i) {
+            C sum = Z[i-f] / U.band(i-f, i-f);
+            for (int j = i+1; j <= M && j <= i+3; ++j)
+                sum -= U.band(i-f, j-f) * W[j-n];
+            W[i-n] = sum;
+        }
+        s->A.insert(s->A.end(), W.begin(), W.end());
+    }
+    return true;
+}
+//////////////////////////////////////////////////////////////////////
+template<class T, class C> int BSplineStream<T, C>::read(T *x, T *y, int n)
+{
+    int nfixed = s->cfirst + s->A.size();
+    int i;
+    for (i = 0; i < n && !s->OX.empty(); ++i) {
+        T xi = s->OX.front();
+        int k = (int)((xi - xmin) / DX);
+        if (!s->closed && k+2 >= nfixed)
+            break;
+        C yi = s->offset;
+        for (int m = my::max(0, k-1); m <= my::min(M, k+2); ++m)
+            yi += s->A[m - s->cfirst] * Basis(m, xi);
+        x[i] = xi;
+        y[i] = yi;
+        s->OX.pop_front();
+    }
+
+    // Drop the coefficients which no remaining sample can reach.
+    int keep = s->klast - 1;
+    if (!s->OX.empty())
+        keep = (int)((s->OX.front() - xmin) / DX) - 1;
+    while (s->cfirst < keep && !s->A.empty()) {
+        s->A.pop_front();
+        ++s->cfirst;
+    }
+    return i;
+}
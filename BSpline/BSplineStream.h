@@ -0,0 +1,145 @@
+/* -*- mode: c++; c-basic-offset: 4; -*- */
+/************************************************************************
+ * Copyright 2009 University Corporation for Atmospheric Research.
+ * All rights reserved.
+ *
+ * Use of this code is subject to the standard BSD license:
+ *
+ *  http://www.opensource.org/licenses/bsd-license.html
+ *
+ * See the COPYRIGHT file in the source distribution for the license text,
+ * or see this web page:
+ *
+ *  http://www.eol.ucar.edu/homes/granger/bspline/doc/
+ *
+ *************************************************************************/
+
+#ifndef BSPLINESTREAM_H
+#define BSPLINESTREAM_H
+
+#include <BSpline/BSplineBase.h>
+
+template <class T, class C> struct BSplineStreamP;
+
+
+/**
+ * Smooth an unbounded stream of samples, such as live telemetry, with the
+ * same cubic b-spline and derivative constraint as BSpline, without
+ * setting up a new domain each time more samples arrive.
+ *
+ * The nodes are laid out at a fixed interval @p dx from the first x
+ * value, and the samples must arrive in order of non-decreasing x.  Each
+ * sample is added into the banded P+Q matrix as it arrives.  Once no
+ * later sample can reach a row of P+Q, that row is factored as LDL' and
+ * forward substituted, one row at a time, so only a fixed-width window
+ * of rows is kept.  Every @p lag nodes, the coefficients are back
+ * substituted from the newest factored row as if the stream ended there,
+ * and the oldest @p lag of them, each at least @p lag nodes behind that
+ * row, are fixed.  The influence of the far end falls by about a factor
+ * of 1000 for each cutoff wavelength of lag, so the default lag of two
+ * wavelengths differs from smoothing the whole stream at once by about
+ * one part in a million of the data, and a lag of five or six
+ * wavelengths agrees to within double rounding.  Each back substitution
+ * covers 2 * lag rows and fixes lag coefficients, so the work per sample
+ * and per node is constant.
+ *
+ * Smoothed values are available from read() once the coefficients of
+ * their interval are fixed, between lag + 7 and 2 * lag + 7 node
+ * intervals behind the newest sample.  Calling finish() applies the
+ * right boundary condition after the last sample and makes the rest of
+ * the values available.
+ *
+ * The curve is fit to the y values less the first y value, which stands
+ * in for the mean removed by BSpline.  For the BC_ZERO_FIRST and
+ * BC_ZERO_SECOND boundary conditions, the result does not depend on
+ * that offset.
+ */
+template <class T, class C = T>
+class BSPLINE_PUBLIC BSplineStream : protected BSplineBase<T, C>
+{
+public:
+    /**
+     * Create a stream with nodes every @p dx starting at @p x0, for the
+     * given cutoff wavelength and boundary condition type.  Unlike
+     * BSplineBase, a wavelength of zero means no derivative constraint at
+     * all, so every node interval needs samples.
+     *
+     * @param x0	The x value of the first node.  No sample may
+     *			precede it.
+     * @param dx	The node interval, greater than zero.
+     * @param wl	The cutoff wavelength, in the same units as x.
+     * @param bc_type	The enumerated boundary condition type, applied
+     *			at @p x0 and at the end of the stream.
+     * @param lag	The least number of nodes between the newest
+     *			factored row and a coefficient fixed from it.  If
+     *			zero, twice the cutoff wavelength is used, but at
+     *			least 8 nodes.
+     */
+    BSplineStream (T x0, double dx, double wl,
+		   int bc_type = BSplineBase<T, C>::BC_ZERO_SECOND,
+		   int lag = 0);
+
+    /**
+     * Add the sample (@p x, @p y) to the stream.  Returns false if the
+     * stream is not ok() or has been finished, if @p x precedes the
+     * first node or the previous sample, or if a row of P+Q could not be
+     * factored, in which case the stream is no longer ok().
+     */
+    bool add (T x, T y);
+
+    /**
+     * Copy up to @p n of the oldest smoothed samples whose values are
+     * final into @p x and @p y, and remove them from the stream.  The x
+     * values are those passed to add().  Returns the number of samples
+     * copied.
+     */
+    int read (T *x, T *y, int n);
+
+    /**
+     * End the stream at the node following the last sample, or at the
+     * last sample if it falls on a node, and apply the boundary
+     * condition there, so that read() returns all of the remaining
+     * samples.  No samples can be added afterwards.  Returns
+     * false if there were no samples or the solution failed.
+     */
+    bool finish ();
+
+    /// Return the number of nodes of lag used to fix the coefficients.
+    int lag ();
+
+    virtual ~BSplineStream ();
+
+    using BSplineBase<T, C>::Debug;
+    using BSplineBase<T, C>::ok;
+    using BSplineBase<T, C>::Xmin;
+    using BSplineBase<T, C>::Alpha;
+
+protected:
+
+    using BSplineBase<T, C>::OK;
+    using BSplineBase<T, C>::M;
+    using BSplineBase<T, C>::DX;
+    using BSplineBase<T, C>::BC;
+    using BSplineBase<T, C>::base;
+    using BSplineBase<T, C>::xmin;
+    using BSplineBase<T, C>::xmax;
+    using BSplineBase<T, C>::alpha;
+    using BSplineBase<T, C>::waveLength;
+    using BSplineBase<T, C>::Basis;
+    using BSplineBase<T, C>::qRow;
+
+    C *row (int m);
+    void addSample (T x, T y);
+    bool factorRow ();
+    void solveLag ();
+
+    // Our hidden state structure
+    BSplineStreamP<T, C> *s;
+
+private:
+    // The stream cannot be copied.
+    BSplineStream (const BSplineStream &);
+    BSplineStream &operator= (const BSplineStream &);
+};
+
+#endif
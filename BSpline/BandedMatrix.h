@@ -35,7 +35,7 @@ public:
 
     // Create a banded matrix with the same number of bands above and below
     // the diagonal.
-    BandedMatrix (int N_ = 1, int nbands_off_diagonal = 0) : bands(0)
+    BandedMatrix (int N_ = 1, int nbands_off_diagonal = 0)
     {
 	if (! setup (N_, nbands_off_diagonal))
 	    setup ();
@@ -44,18 +44,12 @@ public:
     // Create a banded matrix by naming the first and last non-zero bands,
     // where the diagonal is at zero, and bands below the diagonal are
     // negative, bands above the diagonal are positive.
-    BandedMatrix (int N_, int first, int last) : bands(0)
+    BandedMatrix (int N_, int first, int last)
     {
 	if (! setup (N_, first, last))
 	    setup ();
     }
 
-    // Copy constructor
-    BandedMatrix (const BandedMatrix &b) : bands(0)
-    {
-	Copy (*this, b);
-    }
-
     inline bool setup (int N_ = 1, int noff = 0)
     {
 	return setup (N_, -noff, noff);
@@ -65,99 +59,63 @@ public:
     {
 	// Check our limits first and make sure they make sense.
 	// Don't change anything until we know it will work.
+	// Bands may reach past the corners of a small matrix, since those
+	// slots are never used.
 	if (first > last || N_ <= 0)
 	    return false;
 
-	// Need at least as many N_ as columns and as rows in the bands.
-	if (N_ < abs(first) || N_ < abs(last))
-	    return false;
-
 	top = last;
 	bot = first;
 	N = N_;
 	out_of_bounds = T();
 
-	// Finally setup the diagonal vectors
+	// The bands are stored contiguously and interleaved by row, like
+	// LAPACK band storage transposed: row i holds the elements (i,
+	// i+bot) through (i, i+top).  The slots which fall outside the
+	// matrix in the first and last rows are never used.
 	nbands = last - first + 1;
-	if (bands) delete[] bands;
-	bands = new std::vector<T>[nbands];
-	int i;
-	for (i = 0; i < nbands; ++i)
-	{
-	    // The length of each array varies with its distance from the
-	    // diagonal
-	    int len = N - (abs(bot + i));
-	    bands[i].clear ();
-	    bands[i].resize (len);
-	}
+	bands.clear ();
+	bands.resize ((size_t)N * nbands);
 	return true;
     }
 
-    BandedMatrix<T> & operator= (const BandedMatrix<T> &b) 
-    {
-		Copy (*this, b);
-		return *this;
-    }
-
     BandedMatrix<T> & operator= (const T &e)
     {
-	int i;
-	for (i = 0; i < nbands; ++i)
-	{
-	    std::fill_n (bands[i].begin(), bands[i].size(), e);
-	}
+	std::fill (bands.begin(), bands.end(), e);
 	out_of_bounds = e;
 	return (*this);
     }
 
-    ~BandedMatrix ()
-    {
-	if (bands)
-	    delete[] bands;
-    }
-
 private:
     // Return false if coordinates are out of bounds
-    inline bool check_bounds (int i, int j, int &v, int &e) const
+    inline bool check_bounds (int i, int j, int &v) const
     {
 	v = (j - i) - bot;
-	e = (i >= j) ? j : i;
-	return !(v < 0 || v >= nbands || 
-		 e < 0 || (unsigned int)e >= bands[v].size());
+	return !(v < 0 || v >= nbands ||
+		 i < 0 || i >= N || j < 0 || j >= N);
     }
 
     static BandedMatrix & Copy (BandedMatrix &a, const BandedMatrix &b)
     {
-	if (a.bands) delete[] a.bands;
-	a.top = b.top;
-	a.bot = b.bot;
-	a.N = b.N;
-	a.out_of_bounds = b.out_of_bounds;
-	a.nbands = a.top - a.bot + 1;
-	a.bands = new std::vector<T>[a.nbands];
-	int i;
-	for (i = 0; i < a.nbands; ++i)
-	{
-	    a.bands[i] = b.bands[i];
-	}
+	a = b;
 	return a;
     }
 
 public:
     T &element (int i, int j)
     {
-	int v, e;
-	if (check_bounds(i, j, v, e))
-	    return (bands[v][e]);
+	int v;
+	if (check_bounds(i, j, v))
+	    return (bands[(size_t)i * nbands + v]);
 	else
 	    return out_of_bounds;
     }
 
     const T &element (int i, int j) const
     {
-	int v, e;
-	if (check_bounds(i, j, v, e))
-	    return (bands[v][e]);
+	int v;
+	if (check_bounds(i, j, v))
+	    return (bands[(size_t)i * nbands + v]);
 	else
 	    return out_of_bounds;
     }
@@ -172,6 +130,26 @@ public:
 	return element (i-1,j-1);
     }
 
+    // Unchecked access to element (i, j), which must lie within the
+    // bands of the matrix.
+    inline T & band (int i, int j)
+    {
+	return bands[(size_t)i * nbands + (j - i) - bot];
+    }
+
+    inline const T & band (int i, int j) const
+    {
+	return bands[(size_t)i * nbands + (j - i) - bot];
+    }
+
+    // The contiguous band storage, for the unchecked kernels below.
+    // Element (i, j) is at storage()[i*row_width() + (j - i) - first_band()].
+    T *storage () { return &bands[0]; }
+    const T *storage () const { return &bands[0]; }
+    int row_width () const { return nbands; }
+    int first_band () const { return bot; }
+    int last_band () const { return top; }
+
     size_type num_rows() const { return N; }
 
     size_type num_cols() const { return N; }
@@ -192,7 +170,7 @@ private:
     int top;
     int bot;
     int nbands;
-    std::vector<T> *bands;
+    std::vector<T> bands;
     int N;
     T out_of_bounds;
 
@@ -372,5 +350,379 @@ int LU_solve_banded(const MT &A, Vector &b, unsigned int bands)
 }
 
 
+
+/*
+ * The banded LU factorization and solutions above, run directly on the
+ * contiguous storage of a BandedMatrix without any bounds checks or
+ * out-of-bounds fallback.  The arithmetic is the same, so the results are
+ * identical.  Indices are zero-based, and @p bands must not exceed the
+ * number of bands stored on either side of the diagonal.
+ */
+template <class T>
+int LU_factor_banded_storage (BandedMatrix<T> &A, int bands)
+{
+    const int N = A.num_rows();
+    const int ld = A.row_width();
+    T *a = A.storage() - A.first_band();	// a[i*ld + j-i] is A(i,j)
+    int i, j, k;
+    T sum;
+
+    for (j = 0; j < N; ++j)
+    {
+	T *aj = a + (size_t)j*ld;
+	if (aj[0] == 0)
+	    return 1;
+
+	// Rows above and on the diagonal.
+	const int lo = (j > bands) ? j-bands : 0;
+	for (i = lo; i <= j; ++i)
+	{
+	    T *ai = a + (size_t)i*ld;
+	    sum = 0;
+	    for (k = lo; k < i; ++k)
+		sum += ai[k-i] * a[(size_t)k*ld + j-k];
+	    ai[j-i] -= sum;
+	}
+
+	// Rows below the diagonal.
+	for (i = j+1; i < N && i <= j+bands; ++i)
+	{
+	    T *ai = a + (size_t)i*ld;
+	    sum = 0;
+	    for (k = (i > bands) ? i-bands : 0; k < j; ++k)
+		sum += ai[k-i] * a[(size_t)k*ld + j-k];
+	    ai[j-i] = (ai[j-i] - sum) / aj[0];
+	}
+    }
+    return 0;
+}
+
+
+template <class T, class Vector>
+int LU_solve_banded_storage (const BandedMatrix<T> &A, Vector &b, int bands)
+{
+    const int N = A.num_rows();
+    const int ld = A.row_width();
+    const T *a = A.storage() - A.first_band();
+    int i, j;
+    T sum;
+
+    if (N == 0)
+	return 1;
+
+    for (i = 1; i < N; ++i)
+    {
+	const T *ai = a + (size_t)i*ld;
+	sum = b[i];
+	for (j = (i > bands) ? i-bands : 0; j < i; ++j)
+	    sum -= ai[j-i] * b[j];
+	b[i] = sum;
+    }
+
+    b[N-1] /= a[(size_t)(N-1)*ld];
+    for (i = N-2; i >= 0; --i)
+    {
+	const T *ai = a + (size_t)i*ld;
+	if (ai[0] == 0)
+	    return 1;
+	sum = b[i];
+	for (j = i+1; j < N && j <= i+bands; ++j)
+	    sum -= ai[j-i] * b[j];
+	b[i] = sum / ai[0];
+    }
+    return 0;
+}
+
+
+/*
+ * Solve (LU)X = B for @p nrhs right-hand sides at once.  The columns of B
+ * are interleaved by row, so b[i*nrhs + c] is row i of column c.  The
+ * substitution walks the bands once, and the innermost loops run
+ * contiguously across the right-hand sides so they can be vectorized.
+ */
+template <class T, class U>
+int LU_solve_banded_many_storage (const BandedMatrix<T> &A, U *b,
+				  unsigned int nrhs, int bands)
+{
+    const int N = A.num_rows();
+    const int ld = A.row_width();
+    const T *a = A.storage() - A.first_band();
+    int i, j;
+    unsigned int c;
+
+    if (N == 0 || nrhs == 0)
+	return 1;
+
+    for (i = 1; i < N; ++i)
+    {
+	const T *ai = a + (size_t)i*ld;
+	U *bi = b + (size_t)i*nrhs;
+	for (j = (i > bands) ? i-bands : 0; j < i; ++j)
+	{
+	    const U aij = ai[j-i];
+	    const U *bj = b + (size_t)j*nrhs;
+	    for (c = 0; c < nrhs; ++c)
+		bi[c] -= aij*bj[c];
+	}
+    }
+
+    for (i = N-1; i >= 0; --i)
+    {
+	const T *ai = a + (size_t)i*ld;
+	if (ai[0] == 0)
+	    return 1;
+	U *bi = b + (size_t)i*nrhs;
+	for (j = i+1; j < N && j <= i+bands; ++j)
+	{
+	    const U aij = ai[j-i];
+	    const U *bj = b + (size_t)j*nrhs;
+	    for (c = 0; c < nrhs; ++c)
+		bi[c] -= aij*bj[c];
+	}
+	const U d = ai[0];
+	for (c = 0; c < nrhs; ++c)
+	    bi[c] /= d;
+    }
+    return 0;
+}
+
+
+/*
+ * Factor row @p j of a symmetric banded matrix as U'DU, in raw band
+ * storage @p a with row width @p ld and @p n rows, where the rows before
+ * j have already been factored.  Only the rows from j-bands through
+ * j+bands are referenced, so the caller can factor a matrix one row at a
+ * time as its rows become complete.  @p v is scratch space for @p bands
+ * values.  Returns nonzero if a zero pivot occurs.
+ */
+template <class T>
+int LDLT_factor_banded_row (T *a, int ld, int n, int j, int bands, T *v)
+{
+    T *aj = a + (size_t)j*ld;
+    const int lo = (j > bands) ? j-bands : 0;
+    int i, k;
+    T sum;
+
+    // The diagonal, D(j).
+    sum = aj[0];
+    for (k = lo; k < j; ++k)
+    {
+	const T *ak = a + (size_t)k*ld;
+	v[j-k-1] = ak[j-k] * ak[0];
+	sum -= ak[j-k] * v[j-k-1];
+    }
+    if (sum == 0)
+	return 1;
+    aj[0] = sum;
+
+    // Row j of U.
+    for (i = j+1; i < n && i <= j+bands; ++i)
+    {
+	sum = aj[i-j];
+	for (k = (i > bands) ? i-bands : 0; k < j; ++k)
+	    sum -= v[j-k-1] * a[(size_t)k*ld + i-k];
+	aj[i-j] = sum / aj[0];
+    }
+    return 0;
+}
+
+
+/*
+ * Factor a symmetric banded matrix as U'DU, where U is unit upper
+ * triangular, D is diagonal, and U' is the transpose of U.  This is the
+ * banded LDL' factorization with L = U'.  Only the diagonal and the upper
+ * bands are stored, so A must have been set up with first_band() zero and
+ * at least @p bands upper bands.  D replaces the diagonal and U replaces
+ * the upper bands.  No pivoting is done, so A should be positive definite
+ * or otherwise diagonally dominant.  Returns nonzero if a zero pivot
+ * occurs.
+ */
+template <class T>
+int LDLT_factor_banded_storage (BandedMatrix<T> &A, int bands)
+{
+    const int N = A.num_rows();
+    std::vector<T> v(bands);		// v[j-k-1] is U(k,j)*D(k)
+
+    if (A.first_band() != 0 || A.last_band() < bands)
+	return 1;
+
+    for (int j = 0; j < N; ++j)
+    {
+	if (LDLT_factor_banded_row(A.storage(), A.row_width(), N, j,
+				   bands, &v[0]) != 0)
+	    return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * Solve U'DUx = b, given the factorization of @p N rows in raw band
+ * storage @p a with row width @p ld, as in LDLT_solve_banded_many_rows().
+ */
+template <class T, class Vector>
+int LDLT_solve_banded_rows (const T *a, int ld, int N, Vector &b, int bands)
+{
+    int i, j;
+    T sum;
+
+    if (N == 0)
+	return 1;
+
+    // Forward substitution through U', then scale by D.
+    for (i = 0; i < N; ++i)
+    {
+	sum = b[i];
+	for (j = (i > bands) ? i-bands : 0; j < i; ++j)
+	    sum -= a[(size_t)j*ld + i-j] * b[j];
+	b[i] = sum;
+    }
+    for (i = 0; i < N; ++i)
+    {
+	if (a[(size_t)i*ld] == 0)
+	    return 1;
+	b[i] /= a[(size_t)i*ld];
+    }
+
+    // Backward substitution through U.
+    for (i = N-2; i >= 0; --i)
+    {
+	const T *ai = a + (size_t)i*ld;
+	sum = b[i];
+	for (j = i+1; j < N && j <= i+bands; ++j)
+	    sum -= ai[j-i] * b[j];
+	b[i] = sum;
+    }
+    return 0;
+}
+
+
+/*
+ * Solve U'DUx = b, given the factorization from LDLT_factor_banded_storage().
+ */
+template <class T, class Vector>
+int LDLT_solve_banded_storage (const BandedMatrix<T> &A, Vector &b,
+			       int bands)
+{
+    return LDLT_solve_banded_rows(A.storage(), A.row_width(), A.num_rows(),
+				  b, bands);
+}
+
+
+/*
+ * Solve U'DUX = B for @p nrhs right-hand sides interleaved by row, as in
+ * LU_solve_banded_many_storage(), given the factorization of @p N rows in
+ * raw band storage @p a with row width @p ld, as from
+ * LDLT_factor_banded_row().  Any elements of rows past N are ignored, so
+ * this also solves with a block of consecutive rows factored on their
+ * own.
+ */
+template <class T, class U>
+int LDLT_solve_banded_many_rows (const T *a, int ld, int N, U *b,
+				 unsigned int nrhs, int bands)
+{
+    int i, j;
+    unsigned int c;
+
+    if (N == 0 || nrhs == 0)
+	return 1;
+
+    for (i = 0; i < N; ++i)
+    {
+	U *bi = b + (size_t)i*nrhs;
+	for (j = (i > bands) ? i-bands : 0; j < i; ++j)
+	{
+	    const U uji = a[(size_t)j*ld + i-j];
+	    const U *bj = b + (size_t)j*nrhs;
+	    for (c = 0; c < nrhs; ++c)
+		bi[c] -= uji*bj[c];
+	}
+    }
+    for (i = 0; i < N; ++i)
+    {
+	const U d = a[(size_t)i*ld];
+	if (d == 0)
+	    return 1;
+	U *bi = b + (size_t)i*nrhs;
+	for (c = 0; c < nrhs; ++c)
+	    bi[c] /= d;
+    }
+    for (i = N-2; i >= 0; --i)
+    {
+	const T *ai = a + (size_t)i*ld;
+	U *bi = b + (size_t)i*nrhs;
+	for (j = i+1; j < N && j <= i+bands; ++j)
+	{
+	    const U uij = ai[j-i];
+	    const U *bj = b + (size_t)j*nrhs;
+	    for (c = 0; c < nrhs; ++c)
+		bi[c] -= uij*bj[c];
+	}
+    }
+    return 0;
+}
+
+
+/*
+ * Solve U'DUX = B for @p nrhs right-hand sides interleaved by row, as in
+ * LU_solve_banded_many_storage().
+ */
+template <class T, class U>
+int LDLT_solve_banded_many_storage (const BandedMatrix<T> &A, U *b,
+				    unsigned int nrhs, int bands)
+{
+    return LDLT_solve_banded_many_rows(A.storage(), A.row_width(),
+				       A.num_rows(), b, nrhs, bands);
+}
+
+
+/*
+ * Replace the U'DU factorization of @p N rows in raw band storage @p a
+ * with row width @p ld, as from LDLT_factor_banded_row(), with the
+ * elements of the inverse Z of the matrix within the same bands.  This
+ * is the selected inversion of Takahashi, Fagan, and Chen: from
+ * UZ = D^-1 U'^-1, for j >= i,
+ *
+ *   Z(i,j) = delta(i,j)/D(i) - sum over k > i of U(i,k) Z(k,j)
+ *
+ * and the sum only reaches elements of Z within the bands of rows i+1
+ * through i+bands, so the rows are replaced from the last one up in
+ * O(N*bands^2) operations, without the rest of the inverse.  Returns
+ * nonzero if a pivot is zero.
+ */
+template <class T>
+int LDLT_inverse_banded_rows (T *a, int ld, int N, int bands)
+{
+    std::vector<T> z(bands+1);
+    int i, j, k;
+    T sum;
+
+    for (i = N-1; i >= 0; --i)
+    {
+	T *ai = a + (size_t)i*ld;
+	const int last = std::min(N-1, i+bands);
+	if (ai[0] == 0)
+	    return 1;
+
+	// Z(i,j) above the diagonal, where Z(k,j) for k > j is the
+	// already replaced Z(j,k).
+	for (j = i+1; j <= last; ++j)
+	{
+	    sum = 0;
+	    for (k = i+1; k <= last; ++k)
+		sum += ai[k-i] * ((k <= j) ? a[(size_t)k*ld + j-k] :
+				  a[(size_t)j*ld + k-j]);
+	    z[j-i] = -sum;
+	}
+	sum = 1 / ai[0];
+	for (k = i+1; k <= last; ++k)
+	    sum -= ai[k-i] * z[k-i];
+	z[0] = sum;
+	std::copy(z.begin(), z.begin() + (last-i+1), ai);
+    }
+    return 0;
+}
+
+
 #endif /* _BANDEDMATRIX_ID */
 
@@ -58,6 +58,12 @@ docfiles = env.Split("""
  BSpline.h
  BSplineBase.cpp
  BSplineBase.h
+ BSplineDomainCache.cpp
+ BSplineDomainCache.h
+ BSplineEvaluationPlan.cpp
+ BSplineEvaluationPlan.h
+ BSplineStream.cpp
+ BSplineStream.h
  BandedMatrix.h
 """)
 docfiles.extend(IMAGES)
@@ -0,0 +1,350 @@
+/************************************************************************
+ * Copyright 2009 University Corporation for Atmospheric Research.
+ * All rights reserved.
+ *
+ * Use of this code is subject to the standard BSD license:
+ *
+ *  http://www.opensource.org/licenses/bsd-license.html
+ *
+ * See the COPYRIGHT file in the source distribution for the license text,
+ * or see this web page:
+ *
+ *  http://www.eol.ucar.edu/homes/granger/bspline/doc/
+ *
+ *************************************************************************/
+
+/*
+ * Time the setup, solution, and evaluation of splines over a synthetic
+ * data set, and compare the accuracy of each datum and compute type
+ * combination against BSpline<double>.
+ *
+ * usage: bspline_benchmark [npoints [wavelength [bc]]]
+ *        bspline_benchmark setup
+ *        bspline_benchmark solver [threads]
+ *        bspline_benchmark threads
+ *
+ * The second form times Setup(), which scans the x values and searches
+ * for the number of nodes, and the whole setup of a BSplineBase<double>
+ * domain, for a range of sizes and cutoff wavelengths.
+ *
+ * The third form times the factorization of P+Q and one solution with
+ * SOLVER_LDLT and with SOLVER_PARTITIONED for up to the given number of
+ * threads, by default the number of hardware threads, and reports the
+ * speedup of the partitioned solver.  It returns nonzero if a timed
+ * factor does not give the same solution as the one setDomain() leaves.
+ *
+ * The fourth form checks that a float spline whose P is added up by two
+ * threads matches the one added up by a single thread.  Half of its
+ * points sit at an x value where the node interval computed in float and
+ * in double differ, which once put rows outside a thread's buffer.  It
+ * returns nonzero if the splines differ.
+ */
+
+#include <BSpline/BSplineBase.cpp>
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <cmath>
+#include <chrono>
+#include <thread>
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static double
+seconds(Clock::time_point start)
+{
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Repeat each timing and keep the fastest.
+static const int NREPEAT = 5;
+
+struct Result
+{
+    double setup;
+    double solve;
+    double evaluate;
+    vector<double> y;
+};
+
+template <class T, class C>
+static Result
+run(const vector<double> &xd, const vector<double> &yd, double wl, int bc,
+    const vector<double> &xe)
+{
+    vector<T> x(xd.begin(), xd.end());
+    vector<T> y(yd.begin(), yd.end());
+    vector<T> xi(xe.begin(), xe.end());
+    vector<T> yi(xe.size());
+    Result r;
+    r.setup = r.solve = r.evaluate = 1e30;
+
+    BSplineBase<T, C> *base = 0;
+    for (int i = 0; i < NREPEAT; ++i) {
+        delete base;
+        Clock::time_point start = Clock::now();
+        base = new BSplineBase<T, C>(&x[0], x.size(), wl, bc);
+        r.setup = min(r.setup, seconds(start));
+    }
+    BSpline<T, C> spline(*base, &y[0]);
+    for (int i = 0; i < NREPEAT; ++i) {
+        Clock::time_point start = Clock::now();
+        spline.solve(&y[0]);
+        r.solve = min(r.solve, seconds(start));
+    }
+    for (int i = 0; i < NREPEAT; ++i) {
+        Clock::time_point start = Clock::now();
+        spline.evaluate(&xi[0], xi.size(), &yi[0]);
+        r.evaluate = min(r.evaluate, seconds(start));
+    }
+    if (!spline.ok())
+        cerr << "spline solution failed" << endl;
+    r.y.assign(yi.begin(), yi.end());
+    delete base;
+    return r;
+}
+
+static void
+report(const string &name, const Result &r, const Result &ref)
+{
+    double err = 0;
+    for (size_t i = 0; i < r.y.size(); ++i)
+        err = max(err, fabs(r.y[i] - ref.y[i]));
+    cout << setw(16) << left << name << right << fixed << setprecision(3)
+         << setw(10) << r.setup * 1e3
+         << setw(10) << r.solve * 1e3
+         << setw(10) << r.evaluate * 1e3
+         << scientific << setprecision(2) << setw(12) << err << endl;
+}
+
+/*
+ * Expose Setup(), which finds the x range and the number of nodes, to time
+ * it apart from the rest of the domain setup.  This needs the template
+ * implementation.
+ */
+class SetupTimer : public BSplineBase<double>
+{
+public:
+    SetupTimer(const vector<double> &x, double wl)
+    {
+        base->X = x;
+        NX = x.size();
+        waveLength = wl;
+    }
+
+    double time(int *nodes)
+    {
+        double best = 1e30;
+        for (int i = 0; i < NREPEAT; ++i) {
+            Clock::time_point start = Clock::now();
+            bool ok = Setup();
+            best = min(best, seconds(start));
+            *nodes = ok ? M + 1 : 0;
+        }
+        return best;
+    }
+};
+
+static int
+benchmarkSetup()
+{
+    cout << setw(10) << "npoints" << setw(10) << "wl/span"
+         << setw(10) << "nodes" << setw(12) << "Setup ms"
+         << setw(12) << "domain ms" << endl;
+    const int sizes[] = { 10000, 100000, 1000000, 10000000 };
+    const double fractions[] = { 0.1, 0.01, 1e-3, 1e-4, 1e-5 };
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); ++i) {
+        vector<double> x(sizes[i]);
+        for (int j = 0; j < sizes[i]; ++j)
+            x[j] = 1000.0 + 0.01 * j;
+        double span = x.back() - x.front();
+        for (size_t k = 0; k < sizeof(fractions)/sizeof(fractions[0]); ++k) {
+            double wl = span * fractions[k];
+            int nodes = 0;
+            double tsetup = SetupTimer(x, wl).time(&nodes);
+            if (nodes == 0)
+                continue;
+            double tdomain = 1e30;
+            for (int r = 0; r < NREPEAT; ++r) {
+                Clock::time_point start = Clock::now();
+                BSplineBase<double> base(&x[0], x.size(), wl);
+                tdomain = min(tdomain, seconds(start));
+            }
+            cout << setw(10) << sizes[i] << setw(10) << fractions[k]
+                 << setw(10) << nodes << fixed << setprecision(3)
+                 << setw(12) << tsetup * 1e3 << setw(12) << tdomain * 1e3
+                 << endl;
+            cout.unsetf(ios::fixed);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Expose factor() and solveBanded() to time them apart from the assembly
+ * of P+Q, and check that the timed factor solves P+Q like the one which
+ * setDomain() leaves for BSpline::solve().
+ */
+class SolverTimer : public BSplineBase<double>
+{
+public:
+    SolverTimer(const vector<double> &x, double wl, int solver, int nthreads)
+    {
+        threads(nthreads);
+        setSolver(solver);
+        setDomain(&x[0], x.size(), wl);
+        expected.assign(nNodes(), 1.0);
+        solveBanded(&expected[0], 1);
+        assemble();
+        assembled = base->Q;
+    }
+
+    // Return the fastest time of factor() and of solveBanded() for a
+    // right-hand side of ones, and the largest difference of the solution
+    // from that of the setDomain() factor, relative to its largest value.
+    double time(double *tfactor, double *tsolve)
+    {
+        *tfactor = *tsolve = 1e30;
+        for (int i = 0; i < NREPEAT; ++i) {
+            base->Q = assembled;
+            Clock::time_point start = Clock::now();
+            factor();
+            *tfactor = min(*tfactor, seconds(start));
+        }
+        vector<double> a;
+        for (int i = 0; i < NREPEAT; ++i) {
+            a.assign(expected.size(), 1.0);
+            Clock::time_point start = Clock::now();
+            solveBanded(&a[0], 1);
+            *tsolve = min(*tsolve, seconds(start));
+        }
+        double err = 0, scale = 0;
+        for (size_t i = 0; i < a.size(); ++i) {
+            err = max(err, fabs(a[i] - expected[i]));
+            scale = max(scale, fabs(expected[i]));
+        }
+        return (scale > 0) ? err / scale : err;
+    }
+
+private:
+    Matrix<double> assembled;
+    vector<double> expected;
+};
+
+static int
+benchmarkSolver(int maxthreads)
+{
+    if (maxthreads <= 0)
+        maxthreads = max(1, (int)thread::hardware_concurrency());
+    cout << setw(10) << "nodes" << setw(9) << "threads"
+         << setw(12) << "LDLT ms" << setw(12) << "part ms"
+         << setw(10) << "speedup" << endl;
+    const int npoints = 4000000;
+    vector<double> x(npoints);
+    for (int j = 0; j < npoints; ++j)
+        x[j] = 1000.0 + 0.01 * j;
+    const double wls[] = { 1.0, 0.1, 0.03 };
+    int status = 0;
+    for (size_t k = 0; k < sizeof(wls)/sizeof(wls[0]); ++k) {
+        double lf, ls;
+        SolverTimer ldlt(x, wls[k], BSplineBase<double>::SOLVER_LDLT, 1);
+        double err = ldlt.time(&lf, &ls);
+        for (int n = 1; n <= maxthreads; n *= 2) {
+            double pf, ps;
+            SolverTimer part(x, wls[k], BSplineBase<double>::SOLVER_PARTITIONED,
+                             n);
+            err = max(err, part.time(&pf, &ps));
+            cout << setw(10) << ldlt.nNodes() << setw(9) << n
+                 << fixed << setprecision(3)
+                 << setw(12) << (lf + ls) * 1e3 << setw(12) << (pf + ps) * 1e3
+                 << setprecision(2) << setw(10) << (lf + ls) / (pf + ps)
+                 << endl;
+            cout.unsetf(ios::fixed);
+        }
+        if (err > 1e-8) {
+            cerr << "timed factor differs from setDomain() by " << err
+                 << endl;
+            status = 1;
+        }
+    }
+    return status;
+}
+
+static int
+checkThreads()
+{
+    // The first half spans 1.1 to 10000.3 over 1000 nodes, and
+    // (x - xmin) / DX for the second half is just
+    // below 3 in double, but rounds to 4 when x - xmin is taken in float.
+    const int npoints = 32768;
+    vector<float> x(npoints), y(npoints);
+    for (int i = 0; i < npoints; ++i) {
+        if (i < npoints/2)
+            x[i] = 1.1f + (10000.3f - 1.1f) * i / (npoints/2 - 1);
+        else
+            x[i] = 41.136837f;
+        y[i] = 10 * sin(x[i] / 500) + (i % 7) * 0.1f;
+    }
+    vector<float> y1(npoints), y2(npoints);
+    for (int n = 1; n <= 2; ++n) {
+        BSplineBase<float> base;
+        base.threads(n);
+        if (!base.setDomain(&x[0], npoints, 0, 0, 1000)) {
+            cerr << "setDomain() failed with " << n << " threads" << endl;
+            return 1;
+        }
+        BSpline<float> spline(base, &y[0]);
+        spline.evaluate(&x[0], npoints, (n == 1) ? &y1[0] : &y2[0]);
+    }
+    double err = 0;
+    for (int i = 0; i < npoints; ++i)
+        err = max(err, (double)fabs(y1[i] - y2[i]));
+    cout << "float spline, 1 and 2 threads, max difference " << err << endl;
+    return (err < 1e-3) ? 0 : 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    if (argc > 1 && string(argv[1]) == "setup")
+        return benchmarkSetup();
+    if (argc > 1 && string(argv[1]) == "solver")
+        return benchmarkSolver((argc > 2) ? atoi(argv[2]) : 0);
+    if (argc > 1 && string(argv[1]) == "threads")
+        return checkThreads();
+
+    int npoints = (argc > 1) ? atoi(argv[1]) : 200000;
+    double wl = (argc > 2) ? atof(argv[2]) : 30.0;
+    int bc = (argc > 3) ? atoi(argv[3]) : 2;
+
+    // A few waves plus pseudo-random noise over a domain offset from
+    // zero, like time stamps, to stress the float datum type.
+    vector<double> x(npoints), y(npoints);
+    unsigned int seed = 12345;
+    for (int i = 0; i < npoints; ++i) {
+        seed = seed * 1103515245 + 12345;
+        double noise = ((seed >> 8) & 0xffff) / 65536.0 - 0.5;
+        x[i] = 1000.0 + 0.01 * i;
+        y[i] = 10 * sin(x[i] / 50) + 2 * cos(x[i] / 7) + noise;
+    }
+    vector<double> xe(npoints);
+    for (int i = 0; i < npoints; ++i)
+        xe[i] = x[0] + (x[npoints-1] - x[0]) * i / (npoints - 1);
+
+    cout << npoints << " points, wavelength " << wl << ", bc " << bc
+         << endl;
+    cout << setw(16) << left << "type" << right
+         << setw(10) << "setup ms" << setw(10) << "solve ms"
+         << setw(10) << "eval ms" << setw(12) << "max error" << endl;
+
+    Result ref = run<double, double>(x, y, wl, bc, xe);
+    report("double", ref, ref);
+    report("float, double", run<float, double>(x, y, wl, bc, xe), ref);
+    report("float", run<float, float>(x, y, wl, bc, xe), ref);
+    return 0;
+}
@@ -24,6 +24,7 @@
 #include <vector>
 #include <string>
 #include <cstdlib>
+#include <cmath>
 
 using namespace std;
 
@@ -62,6 +63,7 @@ static const char
                     "s:step        <step interval>",
                     "b:bcdegree    <bc derivative degree (0,1,2)> (default is 0)",
                     "n:nodes       <specify number of nodes (n)> (default is 0)",
+                    "g:gcv         <choose the wavelength by GCV from (n) candidates>",
                     "d|debug       <enable diagnostic output>",
                     "v|version     <print version information>",
                     "h|help        <print this help>",
@@ -73,7 +75,10 @@ const char* _usage =
 "using BSpline with the parameters passed as command-line options,\n"
 "and write the result to the output.\n"
 "The output has 4 space-separated columns with a single header line\n"
-"identifying each column.\n";
+"identifying each column.\n"
+"With -g, the wavelength is chosen by generalized cross-validation from\n"
+"n candidates, from the -w wavelength up in steps of sqrt(2), over the\n"
+"nodes for the -w wavelength.\n";
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -85,6 +90,7 @@ void parseCommandLine(int argc,
                       double& wavelength,
                       int& bc,
                       int& num_nodes,
+                      int& candidates,
                       bool& debug)
 {
 
@@ -92,6 +98,7 @@ void parseCommandLine(int argc,
     step = 0;
     bc = SplineBase::BC_ZERO_SECOND;
     num_nodes = 0;
+    candidates = 0;
     debug = false;
 
     // indicate that the wavelength has not been set
@@ -179,6 +186,14 @@ void parseCommandLine(int argc,
                     err++;
                 break;
             }
+        case 'g':
+            {
+                if (optarg)
+                    candidates = atoi(optarg);
+                else
+                    err++;
+                break;
+            }
         case 'd':
             {
                 debug = true;
@@ -212,6 +227,7 @@ int main(int argc,
     double wavelength;
     int bc;
     int num_nodes;
+    int candidates;
     bool debug;
 
     parseCommandLine(argc,
@@ -222,6 +238,7 @@ int main(int argc,
                      wavelength,
                      bc,
                      num_nodes,
+                     candidates,
                      debug);
 
     if (debug) {
@@ -293,6 +310,24 @@ int main(int argc,
     // wavelength.
     if (debug)
         SplineT::Debug(1);
+    if (candidates > 0) {
+        SplineBase domain(&x[0], x.size(), wavelength, bc, num_nodes);
+        vector<double> wl(candidates), scores(candidates);
+        for (int c = 0; c < candidates; ++c)
+            wl[c] = wavelength * pow(2.0, c / 2.0);
+        if (!domain.selectWavelength(&y[0], &wl[0], candidates, &wavelength,
+                                     &scores[0])) {
+            cerr << "Wavelength selection failed." << endl;
+            exit(1);
+        }
+        if (debug) {
+            for (int c = 0; c < candidates; ++c)
+                cerr << "Wavelength " << wl[c] << ": GCV " << scores[c]
+                     << endl;
+        }
+        cerr << "Selected wavelength " << wavelength << endl;
+        num_nodes = domain.nNodes();
+    }
     SplineT spline(&x[0],
                    x.size(),
                     &y[0],
@@ -359,7 +394,6 @@ void DumpSpline(vector<datum> &xv,
          << setw(20) << "slope(spline(x))"
          << std::endl;
     
-    datum variance = 0;
     bool evalmid = false;
 
     for (unsigned int i = 0; i < 2*xv.size()-1; i += (2 - int(evalmid)))
@@ -372,17 +406,18 @@ void DumpSpline(vector<datum> &xv,
         datum y = (y1 + y2)/datum(2);
         *out << setw(10) << x;
         *out << setw(10) << y;
-        datum ys = spline.evaluate(x);
+        datum ys, slope;
+        spline.evaluateWithDerivatives(x, &ys, &slope);
         *out << setw(15) << ys;
-        datum slope = spline.slope(x);
         *out << setw(20) << slope;
         *out << endl;
-        if (i % 2 == 0)
-            variance += (ys - yv[i >> 1])*(ys - yv[i >> 1]);
     }
-    variance /= (datum)xv.size();
-    if (debug)
-        cerr << "Variance: " << variance << endl;
+    if (debug) {
+        SplineT::Residuals r = spline.residualStats(&yv[0]);
+        cerr << "Variance: " << r.rms * r.rms << endl;
+        cerr << "Largest residual: " << r.maxAbs << " at x = "
+             << (r.worst >= 0 ? xv[r.worst] : 0) << endl;
+    }
 }
 
 /*